@@ -1,17 +1,29 @@
 # a proper makefile would be nice, but this is functional
 
+# jack_core, what both tools are built on: jack client and port setup,
+# interleaving kernels, the rings (pa_ringbuffer's) and a delay line, and
+# RT-safe logging and histograms
+for src in jack_core/*.c pa_ringbuffer/pa_ringbuffer.c; do
+    gcc -O3 -Wall -Wextra -Wunused \
+        -c -o "${src%.c}.o" "$src"  \
+        -I ./pa_ringbuffer/ -I ./jack_core/ || exit 1
+done
+ar rcs jack_core/libjack_core.a jack_core/*.o pa_ringbuffer/pa_ringbuffer.o
 
-
-gcc -Wall -Wextra -Wunused         \
+gcc -O3 -Wall -Wextra -Wunused     \
     -o jack_play_record            \
     jack_play_record.c             \
-    pa_ringbuffer/pa_ringbuffer.c  \
+    jpr_sparse.c                   \
     -I ./pa_ringbuffer/            \
-    -ljack -lsndfile -lpthread
-
-gcc -Wall -Wextra -Wunused \
-    -o jack_gain           \
-    jack_gain.c            \
-    -ljack -lm
+    -I ./jack_core/                \
+    -L ./jack_core/ -ljack_core    \
+    -ljack -lsndfile -lm -lpthread -lrt
 
+gcc -O3 -Wall -Wextra -Wunused     \
+    -o jack_gain                   \
+    jack_gain.c                    \
+    -I ./pa_ringbuffer/            \
+    -I ./jack_core/                \
+    -L ./jack_core/ -ljack_core    \
+    -ljack -lm -lpthread -lrt
 
@@ -0,0 +1,55 @@
+/** @file jc_client.c
+ *
+ * @brief jack client and port setup, see jc_client.h.
+ */
+
+#include <stdio.h>
+
+#include "jc_client.h"
+
+jack_client_t *jc_client_open(char *name, size_t name_size) {
+    jack_client_t *client;
+    jack_status_t status;
+
+    client = jack_client_open(name, JackNullOption, &status, NULL);
+    if(client == NULL) {
+        fprintf(stderr, "jack_client_open() failed, status = 0x%2.0x\n", status);
+        if(status & JackServerFailed) {
+            fprintf(stderr, "Unable to connect to JACK server\n");
+        }
+        return NULL;
+    }
+    if(status & JackServerStarted) {
+        fprintf(stderr, "JACK server started\n");
+    }
+    if(status & JackNameNotUnique) {
+        snprintf(name, name_size, "%s", jack_get_client_name(client));
+        fprintf(stderr, "unique name `%s' assigned\n", name);
+    }
+    return client;
+}
+
+int jc_register_ports(jack_client_t *client, jack_port_t **ports, int nports,
+                      const char *prefix, unsigned long flags) {
+    char portname[JC_PORT_NAME_SIZE];
+    int pidx;
+
+    for(pidx=0; pidx<nports; pidx++) {
+        snprintf(portname, JC_PORT_NAME_SIZE, "%s_%02d", prefix, pidx+1);
+        ports[pidx] = jack_port_register(client, portname, JACK_DEFAULT_AUDIO_TYPE, flags, 0);
+        if(ports[pidx] == NULL) {
+            fprintf(stderr, "could not register port %s\n", portname);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void jc_port_buffers(jack_default_audio_sample_t **bufs, jack_port_t *const *ports, int nports,
+                     uint64_t mask, jack_nframes_t nframes) {
+    int pidx;
+
+    for(pidx=0; pidx<nports; pidx++) {
+        bufs[pidx] = (mask & ((uint64_t)1 << pidx)) ? jack_port_get_buffer(ports[pidx], nframes) : NULL;
+    }
+}
@@ -0,0 +1,31 @@
+/** @file jc_client.h
+ *
+ * @brief Opening a jack client and setting up its ports, the way every
+ * one of the jack tools does it.
+ */
+
+#ifndef JC_CLIENT_H
+#define JC_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <jack/jack.h>
+
+#define JC_PORT_NAME_SIZE (2048)
+
+/* open a client called name on the default server, saying on stderr why
+ * not if it can't; name is updated when jack makes it unique.  Returns
+ * NULL on failure. */
+jack_client_t *jc_client_open(char *name, size_t name_size);
+
+/* register nports audio ports named prefix_01, prefix_02, ... with flags
+ * (JackPortIsInput or JackPortIsOutput) in to ports; returns 0 on success */
+int jc_register_ports(jack_client_t *client, jack_port_t **ports, int nports,
+                      const char *prefix, unsigned long flags);
+
+/* get the buffers of the ports whose bit in mask is set, and NULL for the
+ * rest; safe in the process callback */
+void jc_port_buffers(jack_default_audio_sample_t **bufs, jack_port_t *const *ports, int nports,
+                     uint64_t mask, jack_nframes_t nframes);
+
+#endif /* JC_CLIENT_H */
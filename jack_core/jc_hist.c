@@ -0,0 +1,73 @@
+/** @file jc_hist.c
+ *
+ * @brief Log-linear duration histograms, see jc_hist.h.
+ */
+
+#include <time.h>
+
+#include "jc_hist.h"
+
+uint64_t jc_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    int msb, bucket;
+
+    if(ns < JC_HIST_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    bucket = (msb - JC_HIST_SUB_BITS + 1) * JC_HIST_SUB_BUCKETS +
+        (int)((ns >> (msb - JC_HIST_SUB_BITS)) & (JC_HIST_SUB_BUCKETS - 1));
+    return bucket < JC_HIST_BUCKETS ? bucket : JC_HIST_BUCKETS - 1;
+}
+
+/* the first ns past bucket */
+static uint64_t bucket_top(int bucket) {
+    int msb = bucket / JC_HIST_SUB_BUCKETS + JC_HIST_SUB_BITS - 1;
+
+    if(bucket < JC_HIST_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    return (uint64_t)(JC_HIST_SUB_BUCKETS + bucket % JC_HIST_SUB_BUCKETS + 1) << (msb - JC_HIST_SUB_BITS);
+}
+
+void jc_hist_record(jc_hist_t *hist, uint64_t ns) {
+    int bucket = bucket_of(ns);
+
+    // one writer, so no read-modify-write is needed
+    atomic_store_explicit(&(hist->counts[bucket]),
+        atomic_load_explicit(&(hist->counts[bucket]), memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&(hist->total_ns),
+        atomic_load_explicit(&(hist->total_ns), memory_order_relaxed) + ns, memory_order_relaxed);
+    if(ns > atomic_load_explicit(&(hist->max_ns), memory_order_relaxed)) {
+        atomic_store_explicit(&(hist->max_ns), ns, memory_order_relaxed);
+    }
+}
+
+uint64_t jc_hist_count(jc_hist_t *hist) {
+    uint64_t total = 0;
+    int bucket;
+
+    for(bucket=0; bucket<JC_HIST_BUCKETS; bucket++) {
+        total += atomic_load_explicit(&(hist->counts[bucket]), memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t jc_hist_percentile(jc_hist_t *hist, uint64_t total, double pct) {
+    uint64_t seen = 0;
+    int bucket;
+
+    for(bucket=0; bucket<JC_HIST_BUCKETS-1 && total > 0; bucket++) {
+        seen += atomic_load_explicit(&(hist->counts[bucket]), memory_order_relaxed);
+        if(seen >= pct / 100.0 * total) {
+            break;
+        }
+    }
+    return bucket_top(bucket);
+}
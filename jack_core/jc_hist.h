@@ -0,0 +1,41 @@
+/** @file jc_hist.h
+ *
+ * @brief Log-linear histograms of durations that the jack thread can
+ * update.
+ *
+ * Each power of 2 of nanoseconds is split in to JC_HIST_SUB_BUCKETS, so a
+ * bucket is at most 12.5% wide, from 1 ns to over an hour.  A histogram has
+ * one writer, which only does plain loads and stores (of atomics, so that
+ * any other thread may read it at any time); counts read while it's being
+ * written may be a record apart from each other.
+ */
+
+#ifndef JC_HIST_H
+#define JC_HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define JC_HIST_SUB_BITS (3)
+#define JC_HIST_SUB_BUCKETS (1 << JC_HIST_SUB_BITS)
+#define JC_HIST_BUCKETS (40 * JC_HIST_SUB_BUCKETS) // up to 2^42 ns
+
+typedef struct jc_hist {
+    atomic_uint_fast64_t counts[JC_HIST_BUCKETS];
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+} jc_hist_t;
+
+/* CLOCK_MONOTONIC in ns; the vdso's, off the tsc, so cheap enough to call per stage */
+uint64_t jc_now_ns(void);
+
+/* count ns in hist, from its one writer */
+void jc_hist_record(jc_hist_t *hist, uint64_t ns);
+
+/* how many durations hist holds */
+uint64_t jc_hist_count(jc_hist_t *hist);
+
+/* the upper bound, in ns, of the bucket holding percentile pct of total */
+uint64_t jc_hist_percentile(jc_hist_t *hist, uint64_t total, double pct);
+
+#endif /* JC_HIST_H */
@@ -0,0 +1,75 @@
+/** @file jc_interleave.c
+ *
+ * @brief Interleaving kernels, see jc_interleave.h.
+ */
+
+#include <stddef.h>
+
+#include "jc_interleave.h"
+
+/* target_clones has gcc emit one copy of each kernel per instruction set
+ * and pick the best for the running cpu (build with -O3) */
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define JC_SIMD_CLONES __attribute__((target_clones("avx2", "avx", "sse4.1", "default")))
+#else
+#define JC_SIMD_CLONES
+#endif
+
+/* one channel in to its slot of every frame */
+JC_SIMD_CLONES
+static void scatter(jack_default_audio_sample_t * restrict dst, const jack_default_audio_sample_t * restrict src,
+                    int stride, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        dst[fidx * stride] = src[fidx];
+    }
+}
+
+/* and back out */
+JC_SIMD_CLONES
+static void gather(jack_default_audio_sample_t * restrict dst, const jack_default_audio_sample_t * restrict src,
+                   int stride, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        dst[fidx] = src[fidx * stride];
+    }
+}
+
+JC_SIMD_CLONES
+static void interleave_stereo(jack_default_audio_sample_t * restrict dst,
+                              const jack_default_audio_sample_t * restrict left,
+                              const jack_default_audio_sample_t * restrict right, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        dst[2*fidx] = left[fidx];
+        dst[2*fidx + 1] = right[fidx];
+    }
+}
+
+void jc_interleave(jack_default_audio_sample_t *dst, jack_default_audio_sample_t *const *srcs,
+                   int nchans, jack_nframes_t offset, jack_nframes_t nframes) {
+    int cidx;
+
+    // a channel at a time walks each source buffer once, in order
+    if(nchans == 2) {
+        interleave_stereo(dst, srcs[0] + offset, srcs[1] + offset, nframes);
+        return;
+    }
+    for(cidx=0; cidx<nchans; cidx++) {
+        scatter(dst + cidx, srcs[cidx] + offset, nchans, nframes);
+    }
+}
+
+void jc_deinterleave(jack_default_audio_sample_t *const *dsts, const jack_default_audio_sample_t *src,
+                     int nsrc_chans, const int *map, int ndsts, jack_nframes_t offset, jack_nframes_t nframes) {
+    int cidx;
+
+    for(cidx=0; cidx<ndsts; cidx++) {
+        if(dsts[cidx] != NULL) {
+            gather(dsts[cidx] + offset, src + (map != NULL ? map[cidx] : cidx), nsrc_chans, nframes);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+/** @file jc_interleave.h
+ *
+ * @brief Moving audio between jack's one-buffer-per-port layout and the
+ * interleaved frames that files and rings hold.
+ */
+
+#ifndef JC_INTERLEAVE_H
+#define JC_INTERLEAVE_H
+
+#include <jack/jack.h>
+
+/* write nframes interleaved frames of nchans channels to dst, channel c
+ * coming from srcs[c][offset...] */
+void jc_interleave(jack_default_audio_sample_t *dst, jack_default_audio_sample_t *const *srcs,
+                   int nchans, jack_nframes_t offset, jack_nframes_t nframes);
+
+/* write channel map[c] (or c, when map is NULL) of src's nframes frames of
+ * nsrc_chans channels to dsts[c][offset...], for each of ndsts buffers that
+ * isn't NULL */
+void jc_deinterleave(jack_default_audio_sample_t *const *dsts, const jack_default_audio_sample_t *src,
+                     int nsrc_chans, const int *map, int ndsts, jack_nframes_t offset, jack_nframes_t nframes);
+
+#endif /* JC_INTERLEAVE_H */
@@ -0,0 +1,235 @@
+/** @file jc_log.c
+ *
+ * @brief The jack tools' non-blocking log, see jc_log.h.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "jc_log.h"
+
+#define JC_LOG_QUEUE_MASK (JC_LOG_QUEUE_SIZE - 1)
+
+typedef struct jc_log_record {
+    atomic_size_t seq;         // pos + 1 once filled for pos, pos + size once popped
+    uint64_t usecs;            // CLOCK_MONOTONIC, when logged
+    uint64_t nrepeats;         // calls at the same site suppressed since its last record
+    jc_log_site_t *site;
+    char msg[JC_LOG_MSG_SIZE];
+} jc_log_record_t;
+
+static jc_log_record_t queue[JC_LOG_QUEUE_SIZE];
+static atomic_size_t enqueue_pos = 0;
+static size_t dequeue_pos = 0;         // only the drain thread pops
+static atomic_uint_fast64_t ndropped = 0;
+static jc_log_site_t *_Atomic sites = NULL;
+static atomic_bool opened = false;
+static atomic_bool stop = false;
+static FILE *out;
+static pthread_t drain_thread;
+static int64_t realtime_offset_usecs;  // CLOCK_REALTIME - CLOCK_MONOTONIC
+
+static uint64_t now_usecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* let one call per interval through at each site, counting the rest */
+static bool site_allows(jc_log_site_t *site, uint64_t usecs) {
+    jc_log_site_t *head;
+    uint_fast64_t last;
+
+    if(!atomic_exchange_explicit(&(site->registered), true, memory_order_acq_rel)) {
+        head = atomic_load_explicit(&sites, memory_order_acquire);
+        do {
+            site->next = head;
+        } while(!atomic_compare_exchange_weak_explicit(&sites, &head, site,
+                    memory_order_release, memory_order_acquire));
+    }
+
+    last = atomic_load_explicit(&(site->last_usecs), memory_order_relaxed);
+    if((last != 0 && usecs - last < JC_LOG_SITE_INTERVAL_USECS) ||
+       !atomic_compare_exchange_strong_explicit(&(site->last_usecs), &last, usecs,
+            memory_order_relaxed, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&(site->nsuppressed), 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void jc_log_at(jc_log_site_t *site, const char *fmt, ...) {
+    jc_log_record_t *rec;
+    size_t pos, seq;
+    uint64_t usecs;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if(!atomic_load_explicit(&opened, memory_order_acquire)) {
+        // no drain thread yet, or any more, so only main is about
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    usecs = now_usecs();
+    if(site != NULL && !site_allows(site, usecs)) {
+        va_end(ap);
+        return;
+    }
+
+    // claim a slot, or give up if the queue is full
+    pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while(1) {
+        rec = &(queue[pos & JC_LOG_QUEUE_MASK]);
+        seq = atomic_load_explicit(&(rec->seq), memory_order_acquire);
+        if(seq == pos) {
+            if(atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if((intptr_t)(seq - pos) < 0) {
+            atomic_fetch_add_explicit(&ndropped, 1, memory_order_relaxed);
+            va_end(ap);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    rec->usecs = usecs;
+    rec->site = site;
+    rec->nrepeats = site == NULL ? 0 :
+        atomic_exchange_explicit(&(site->nsuppressed), 0, memory_order_relaxed);
+    vsnprintf(rec->msg, JC_LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&(rec->seq), pos + 1, memory_order_release);
+}
+
+static void write_time(uint64_t usecs) {
+    int64_t wall = (int64_t)usecs + realtime_offset_usecs;
+    time_t secs = (time_t)(wall / 1000000);
+    struct tm tm;
+    char clock[16];
+
+    localtime_r(&secs, &tm);
+    strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+    fprintf(out, "[%s.%03d] ", clock, (int)((wall % 1000000) / 1000));
+}
+
+/* a message without its trailing newline, which the log adds back */
+static int msg_len(const char *msg) {
+    int len = strlen(msg);
+
+    while(len > 0 && msg[len - 1] == '\n') {
+        len--;
+    }
+    return len;
+}
+
+/* write what's queued; then, for quiet sites (or every site when finishing),
+ * how many calls were suppressed since their last record */
+static void drain(bool finishing) {
+    jc_log_record_t *rec;
+    jc_log_site_t *site;
+    uint64_t usecs = now_usecs(), n;
+    const char *msg;
+
+    while(1) {
+        rec = &(queue[dequeue_pos & JC_LOG_QUEUE_MASK]);
+        if(atomic_load_explicit(&(rec->seq), memory_order_acquire) != dequeue_pos + 1) {
+            break;
+        }
+        msg = rec->msg;
+        while(*msg == '\n') {
+            msg++; // the old printfs' leading blank lines
+        }
+        write_time(rec->usecs);
+        fprintf(out, "%.*s", msg_len(msg), msg);
+        if(rec->nrepeats > 0) {
+            fprintf(out, " (and %" PRIu64 " more like it before this)", rec->nrepeats);
+        }
+        fprintf(out, "\n");
+        if(rec->site != NULL) {
+            snprintf(rec->site->last_msg, JC_LOG_MSG_SIZE, "%.*s", msg_len(msg), msg);
+        }
+        atomic_store_explicit(&(rec->seq), dequeue_pos + JC_LOG_QUEUE_SIZE, memory_order_release);
+        dequeue_pos++;
+    }
+
+    for(site = atomic_load_explicit(&sites, memory_order_acquire); site != NULL; site = site->next) {
+        if(atomic_load_explicit(&(site->nsuppressed), memory_order_relaxed) > 0 &&
+           (finishing || usecs - atomic_load_explicit(&(site->last_usecs), memory_order_relaxed)
+                >= JC_LOG_SITE_INTERVAL_USECS) &&
+           (n = atomic_exchange_explicit(&(site->nsuppressed), 0, memory_order_relaxed)) > 0) {
+            write_time(usecs);
+            fprintf(out, "(and %" PRIu64 " more like: %s)\n", n, site->last_msg);
+        }
+    }
+
+    if((n = atomic_exchange_explicit(&ndropped, 0, memory_order_relaxed)) > 0) {
+        write_time(usecs);
+        fprintf(out, "WRN: the log queue was full, %" PRIu64 " messages were lost\n", n);
+    }
+    fflush(out);
+}
+
+static void *drain_function(void *ptr) {
+    ptr = ptr; // mollify compiler
+    while(!atomic_load_explicit(&stop, memory_order_acquire)) {
+        drain(false);
+        usleep(JC_LOG_DRAIN_USECS);
+    }
+    drain(true);
+    return NULL;
+}
+
+int jc_log_open(FILE *fp) {
+    struct timespec real;
+    sigset_t all, old;
+    size_t idx;
+    int err;
+
+    out = fp != NULL ? fp : stderr;
+    atomic_store_explicit(&enqueue_pos, 0, memory_order_relaxed);
+    dequeue_pos = 0;
+    for(idx=0; idx<JC_LOG_QUEUE_SIZE; idx++) {
+        atomic_init(&(queue[idx].seq), idx);
+    }
+    clock_gettime(CLOCK_REALTIME, &real);
+    realtime_offset_usecs = (int64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000 - (int64_t)now_usecs();
+
+    atomic_store_explicit(&stop, false, memory_order_relaxed);
+    // signals are for whichever thread the program has waiting on them, never this one
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&drain_thread, NULL, drain_function, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err) {
+        return 1;
+    }
+    atomic_store_explicit(&opened, true, memory_order_release);
+    return 0;
+}
+
+void jc_log_close(void) {
+    if(!atomic_exchange_explicit(&opened, false, memory_order_acq_rel)) {
+        return;
+    }
+    atomic_store_explicit(&stop, true, memory_order_release);
+    pthread_join(drain_thread, NULL);
+    if(out != stderr) {
+        fclose(out);
+    }
+}
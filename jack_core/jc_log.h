@@ -0,0 +1,59 @@
+/** @file jc_log.h
+ *
+ * @brief A log that any thread, the jack thread included, can write to
+ * without blocking.
+ *
+ * JC_LOG formats its message in to a fixed size record, and pushes that on
+ * to a bounded lock-free queue (Vyukov's, with a sequence number per slot,
+ * so several threads can push at once).  A background thread pops records
+ * and writes them, with the wall clock time they were logged at, to stderr
+ * or a file.  Pushing never waits and never allocates: when the queue is
+ * full the record is dropped and counted, and the count is written out once
+ * there's room again.
+ *
+ * Each JC_LOG call site is rate limited, to one record per
+ * JC_LOG_SITE_INTERVAL_USECS.  Calls in between are only counted, and the
+ * count is written after the site's last message, so a storm of underflows
+ * becomes a line a second instead of thousands of writes.
+ *
+ * Formatting is vsnprintf's, so stick to integer and string conversions in
+ * the jack thread; they don't allocate.
+ */
+
+#ifndef JC_LOG_H
+#define JC_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define JC_LOG_MSG_SIZE (120)         // bytes of each message, the rest is cut off
+#define JC_LOG_QUEUE_SIZE (256)       // records, a power of 2
+#define JC_LOG_SITE_INTERVAL_USECS (1000000)
+#define JC_LOG_DRAIN_USECS (50000)    // how often the drain thread looks
+
+typedef struct jc_log_site {
+    atomic_uint_fast64_t last_usecs;   // when this site last got a record through
+    atomic_uint_fast64_t nsuppressed;  // calls since then that didn't
+    atomic_bool registered;
+    struct jc_log_site *next;         // in the drain thread's list of sites
+    char last_msg[JC_LOG_MSG_SIZE];   // the drain thread's copy, for the repeat count
+} jc_log_site_t;
+
+/* log a printf style message from anywhere, at most once a second per call site */
+#define JC_LOG(...) do {                       \
+        static jc_log_site_t jc_log_site_;    \
+        jc_log_at(&jc_log_site_, __VA_ARGS__);\
+    } while(0)
+
+/* start the drain thread, writing to fp (stderr when NULL); returns 0 on success */
+int jc_log_open(FILE *fp);
+
+/* JC_LOG's body; site may be NULL for no rate limit */
+void jc_log_at(jc_log_site_t *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* write out everything queued, and the repeat counts, then stop the drain thread */
+void jc_log_close(void);
+
+#endif /* JC_LOG_H */
@@ -0,0 +1,103 @@
+/** @file jc_ring.c
+ *
+ * @brief Ring set up, handoffs and the delay line, see jc_ring.h.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jc_ring.h"
+
+#define ISPOW2(x) ((x) > 0 && !((x) & (x-1)))
+int jc_nextpow2(int x) {
+    if(ISPOW2(x)) {
+        return x;
+    }
+    int power = 1;
+    while (power < x && power < (1 << 30)) power <<= 1;
+    return power;
+}
+
+void *jc_ring_alloc(PaUtilRingBuffer *ring, ring_buffer_size_t elem_size, ring_buffer_size_t nelems) {
+    void *memory;
+
+    nelems = jc_nextpow2(nelems);
+    memory = calloc(nelems, elem_size);
+    if(memory == NULL) {
+        return NULL;
+    }
+    if(PaUtil_InitializeRingBuffer(ring, elem_size, nelems, memory)) {
+        free(memory);
+        return NULL;
+    }
+    return memory;
+}
+
+int jc_handoff_init(jc_handoff_t *handoff) {
+    return sem_init(&(handoff->sem), 0, 0) != 0;
+}
+
+void jc_handoff_post(jc_handoff_t *handoff) {
+    int value;
+
+    if(sem_getvalue(&(handoff->sem), &value) == 0 && value > 0) {
+        return; // already pending
+    }
+    sem_post(&(handoff->sem));
+}
+
+int jc_handoff_wait(jc_handoff_t *handoff, long usecs) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += usecs / 1000000;
+    deadline.tv_nsec += (usecs % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while(sem_timedwait(&(handoff->sem), &deadline)) {
+        if(errno != EINTR) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int jc_delay_init(jc_delay_t *delay, jack_nframes_t nframes, jack_nframes_t max_block) {
+    // a block goes in before the one that comes out of it is taken
+    delay->memory = jc_ring_alloc(&(delay->ring), sizeof(jack_default_audio_sample_t),
+        nframes + max_block);
+    if(delay->memory == NULL) {
+        return 1;
+    }
+    delay->nframes = nframes;
+    // calloc'd, so the first nframes out are silence
+    PaUtil_AdvanceRingBufferWriteIndex(&(delay->ring), nframes);
+    return 0;
+}
+
+void jc_delay_process(jc_delay_t *delay, jack_default_audio_sample_t *out,
+                      const jack_default_audio_sample_t *in, jack_nframes_t nframes) {
+    ring_buffer_size_t nwritten;
+
+    if(delay->nframes == 0) {
+        if(out != in) {
+            memcpy(out, in, sizeof(jack_default_audio_sample_t) * nframes);
+        }
+        return;
+    }
+    nwritten = PaUtil_WriteRingBuffer(&(delay->ring), in, nframes);
+    PaUtil_ReadRingBuffer(&(delay->ring), out, nwritten);
+    if((jack_nframes_t)nwritten < nframes) {
+        // a block larger than max_block, can't keep the delay for all of it
+        memset(out + nwritten, 0, sizeof(jack_default_audio_sample_t) * (nframes - nwritten));
+    }
+}
+
+void jc_delay_free(jc_delay_t *delay) {
+    free(delay->memory);
+    delay->memory = NULL;
+}
@@ -0,0 +1,61 @@
+/** @file jc_ring.h
+ *
+ * @brief Single producer, single consumer rings (pa_ringbuffer's), handoffs
+ * for waiting on them, and a delay line built on one.
+ *
+ * A jc_handoff_t lets one side of a ring sleep until the other has moved
+ * something, instead of polling: for when the jack thread is allowed to
+ * block, i.e. while jack is freewheeling.  Posts coalesce, so a handoff
+ * that nobody waits on doesn't count up forever.
+ *
+ * A jc_delay_t holds back one channel by a fixed number of frames: each
+ * cycle writes its block in and reads the same number of frames out, and
+ * the ring was filled with delay frames of silence to start with.  It's
+ * meant for one thread, the jack thread, so the ring's memory barriers are
+ * never contended.
+ */
+
+#ifndef JC_RING_H
+#define JC_RING_H
+
+#include <semaphore.h>
+#include <jack/jack.h>
+#include <pa_ringbuffer.h>
+
+typedef struct jc_delay {
+    PaUtilRingBuffer ring;
+    void *memory;
+    jack_nframes_t nframes;    // the delay
+} jc_delay_t;
+
+typedef struct jc_handoff {
+    sem_t sem;
+} jc_handoff_t;
+
+/* the smallest power of 2 at or over x */
+int jc_nextpow2(int x);
+
+/* set up ring for at least nelems elements of elem_size bytes, rounded up
+ * to a power of 2; returns the memory to free() later, NULL on failure */
+void *jc_ring_alloc(PaUtilRingBuffer *ring, ring_buffer_size_t elem_size, ring_buffer_size_t nelems);
+
+/* returns 0 on success */
+int jc_handoff_init(jc_handoff_t *handoff);
+
+/* wake the waiter, if any, or the next one to wait; never blocks */
+void jc_handoff_post(jc_handoff_t *handoff);
+
+/* wait up to usecs for a post; returns 0 when posted, 1 on timeout */
+int jc_handoff_wait(jc_handoff_t *handoff, long usecs);
+
+/* set up delay to hold back nframes frames, with blocks of up to max_block
+ * frames; returns 0 on success */
+int jc_delay_init(jc_delay_t *delay, jack_nframes_t nframes, jack_nframes_t max_block);
+
+/* out gets in from delay->nframes frames ago; out may be in */
+void jc_delay_process(jc_delay_t *delay, jack_default_audio_sample_t *out,
+                      const jack_default_audio_sample_t *in, jack_nframes_t nframes);
+
+void jc_delay_free(jc_delay_t *delay);
+
+#endif /* JC_RING_H */
@@ -13,9 +13,21 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // libraries/code that require building/linking
+#include <pthread.h>
 #include <jack/jack.h>
+#include <pa_ringbuffer.h>
+#include "jack_gain_meter.h"
+#include "jc_client.h"
+#include "jc_ring.h"
 
 enum db_or_linear_mode{
     JACK_GAIN_DB_MODE, 
@@ -30,11 +42,640 @@ jack_client_t *client;
 
 #define JACK_CLIENT_NAME_SIZE (2048)
 #define JACK_PORT_NAME_SIZE (2048)
-jack_default_audio_sample_t db_gains[JACK_GAIN_MAX_PORTS] = {0.0};
-jack_default_audio_sample_t linear_gains[JACK_GAIN_MAX_PORTS] = {1.0};
+jack_default_audio_sample_t db_gains[JACK_GAIN_MAX_PORTS];
+jack_default_audio_sample_t linear_gains[JACK_GAIN_MAX_PORTS];
+float ramp_msecs_chans[JACK_GAIN_MAX_PORTS]; // from the gain file, < 0 for -t's
+jack_nframes_t samplerate = 0;
 int jackchans = 0;
 char jackname[JACK_CLIENT_NAME_SIZE] = {0};
 
+// gain file given with -D/-L, re-read on SIGHUP
+#define GAIN_FNAME_SIZE (2048)
+char gain_fname[GAIN_FNAME_SIZE] = {0};
+int gain_fname_mode = -1;
+volatile sig_atomic_t reload_requested = 0;
+
+// Double-buffered gains for handing new values to the jack thread.
+// The main thread fills the bank that is not published, then bumps
+// gain_bank_seq.  The jack thread copies the published bank and stores
+// the seq it copied in gain_bank_ack; the main thread doesn't touch a
+// bank again until the jack thread has acknowledged the last publish.
+typedef struct gain_bank {
+    jack_default_audio_sample_t gains[JACK_GAIN_MAX_PORTS];
+    jack_nframes_t ramp_nframes[JACK_GAIN_MAX_PORTS];
+} gain_bank_t;
+gain_bank_t gain_banks[2];
+atomic_uint gain_bank_seq = 0;
+atomic_uint gain_bank_ack = 0;
+
+// Ramp state, only touched by the jack thread after activation
+enum ramp_shape_mode{
+    JACK_GAIN_RAMP_LINEAR,
+    JACK_GAIN_RAMP_EXPONENTIAL };
+#define JACK_GAIN_RAMP_SEGMENT (16) // frames per linear piece of an exp ramp
+int ramp_shape = JACK_GAIN_RAMP_LINEAR;
+float ramp_msecs = 20.0f;
+jack_nframes_t ramp_nframes = 0;
+unsigned int seen_bank_seq = 0;
+jack_default_audio_sample_t cur_gains[JACK_GAIN_MAX_PORTS];
+jack_default_audio_sample_t target_gains[JACK_GAIN_MAX_PORTS];
+jack_default_audio_sample_t ramp_steps[JACK_GAIN_MAX_PORTS]; // add (lin) or multiply (exp)
+jack_default_audio_sample_t seg_gains[JACK_GAIN_MAX_PORTS]; // exp ramps, gain at segment start
+jack_nframes_t ramp_remaining[JACK_GAIN_MAX_PORTS];
+int ramp_shapes[JACK_GAIN_MAX_PORTS];
+
+// Matrix (router) mode, -m/-M: out[o] = sum over i of gains[o][i] * in[i]
+#define JACK_GAIN_MIN_LINEAR (1e-6f)    // routes quieter than -120 dB are dropped
+#define JACK_GAIN_DENSE_FRACTION (0.5f) // mix densely above this fraction of live routes
+typedef struct gain_matrix {
+    int nin, nout;
+    bool dense;
+    jack_default_audio_sample_t gains[JACK_GAIN_MAX_PORTS][JACK_GAIN_MAX_PORTS]; // [out][in]
+    int nroutes[JACK_GAIN_MAX_PORTS];                        // live routes into each output
+    int route_ins[JACK_GAIN_MAX_PORTS][JACK_GAIN_MAX_PORTS]; // and the inputs they come from
+} gain_matrix_t;
+bool matrix_mode = false;
+gain_matrix_t matrix;          // as last parsed, main thread only
+gain_matrix_t matrix_banks[2]; // double buffer, same protocol as gain_banks
+
+// matrix state only touched by the jack thread after activation; while a
+// ramp runs, ramp_matrix routes the union of old and new routes and holds
+// the current gains
+gain_matrix_t rt_matrix;
+gain_matrix_t ramp_matrix;
+jack_default_audio_sample_t matrix_steps[JACK_GAIN_MAX_PORTS][JACK_GAIN_MAX_PORTS];
+jack_nframes_t matrix_ramp_remaining = 0;
+jack_default_audio_sample_t matrix_scratch[JACK_GAIN_MAX_PORTS][JACK_GAIN_MAX_FRAMES];
+
+// -a, a delay line on every output, so that the meters (and anything else
+// working on the undelayed signal) see the audio before it leaves
+#define JACK_GAIN_MAX_DELAY_MSECS (10000.0f)
+float delay_msecs = 0.0f;
+jack_nframes_t delay_nframes = 0;
+jc_delay_t delays[JACK_GAIN_MAX_PORTS];
+
+// Metering of the outputs, -j/-S.  The jack thread reduces each block to a
+// peak and plain and K-weighted energies, and every ~100 ms hands the
+// totals to meter_thread through meter_ringbuf; meter_thread turns those
+// into levels and loudness and prints or publishes them.
+#define METER_INTERVAL_MSECS (100)     // EBU R128 gating step
+#define METER_RING_INTERVALS (64)      // must be a power of 2
+#define METER_MOMENTARY_INTERVALS (4)  // 400 ms
+#define METER_SHORT_TERM_INTERVALS (30) // 3 s
+#define METER_HIST_MIN_LUFS (-70.0)    // EBU R128 absolute gate
+#define METER_HIST_BINS (1000)         // 0.1 LU bins from -70 to +30 LUFS
+#define METER_SHM_NAME_SIZE (256)
+typedef struct meter_interval {
+    jack_nframes_t nframes;
+    float peaks[JACK_GAIN_MAX_PORTS];
+    double sumsqs[JACK_GAIN_MAX_PORTS];
+    double ksumsqs[JACK_GAIN_MAX_PORTS];
+} meter_interval_t;
+bool meter_enabled = false;
+int meter_msecs = 0;   // -j, print a json line this often
+char meter_shm_name[METER_SHM_NAME_SIZE] = {0}; // -S
+int meter_nchans = 0;
+jack_nframes_t meter_interval_nframes = 0;
+PaUtilRingBuffer meter_ringbuf;
+meter_interval_t meter_ring_memory[METER_RING_INTERVALS];
+atomic_uint meter_dropped = 0;
+FILE *info_fp = NULL; // fyi and SIGHUP's messages; stderr while -j/-S meter, so stdout stays JSON lines
+#define METER_JSON_SIZE (128 + 96 * JACK_GAIN_MAX_PORTS) // one report's line
+// While jack freewheels a full meter_ringbuf holds up the jack thread
+// instead of dropping intervals: meter_process posts meter_wake and waits on
+// meter_consumed, which meter_thread posts after each drain.
+#define METER_STALL_USECS (1000000)
+atomic_bool freewheeling = false;
+jc_handoff_t meter_wake, meter_consumed;
+
+// K-weighting, two biquads per channel, only touched by the jack thread
+double kweight_b[2][3], kweight_a[2][3];
+double kweight_states[JACK_GAIN_MAX_PORTS][2][2];
+meter_interval_t meter_open; // the interval being accumulated
+
+/* gain kernels
+ *
+ * The loops below are written so gcc can vectorize them (build with -O3),
+ * and on x86 target_clones has gcc emit one copy per listed instruction set
+ * and pick the best one for the running cpu when the program is loaded.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define JACK_GAIN_SIMD_CLONES \
+    __attribute__((target_clones("avx512f", "avx2", "avx", "sse4.1", "default")))
+#else
+#define JACK_GAIN_SIMD_CLONES
+#endif
+
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_copy(jack_default_audio_sample_t * restrict out,
+                      const jack_default_audio_sample_t * restrict in,
+                      jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        out[fidx] = in[fidx] * gain;
+    }
+}
+
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_inplace(jack_default_audio_sample_t * restrict buf,
+                         jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        buf[fidx] *= gain;
+    }
+}
+
+/* out = in * (gain + step*(fidx+1)), a linear ramp ending at gain + step*nframes */
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_ramp_copy(jack_default_audio_sample_t * restrict out,
+                           const jack_default_audio_sample_t * restrict in,
+                           jack_default_audio_sample_t gain, jack_default_audio_sample_t step,
+                           jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        out[fidx] = in[fidx] * (gain + step * (jack_default_audio_sample_t)(fidx + 1));
+    }
+}
+
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_ramp_inplace(jack_default_audio_sample_t * restrict buf,
+                              jack_default_audio_sample_t gain, jack_default_audio_sample_t step,
+                              jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        buf[fidx] *= gain + step * (jack_default_audio_sample_t)(fidx + 1);
+    }
+}
+
+static inline void apply_linear_ramp(jack_default_audio_sample_t *out,
+                                     jack_default_audio_sample_t *in,
+                                     jack_default_audio_sample_t gain,
+                                     jack_default_audio_sample_t step,
+                                     jack_nframes_t nframes) {
+    if(out == in) {
+        gain_kernel_ramp_inplace(out, gain, step, nframes);
+    }
+    else {
+        gain_kernel_ramp_copy(out, in, gain, step, nframes);
+    }
+}
+
+/* out += in * gain */
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_mac(jack_default_audio_sample_t * restrict out,
+                     const jack_default_audio_sample_t * restrict in,
+                     jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        out[fidx] += in[fidx] * gain;
+    }
+}
+
+/* out += in * (gain + step*(fidx+1)) */
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_ramp_mac(jack_default_audio_sample_t * restrict out,
+                          const jack_default_audio_sample_t * restrict in,
+                          jack_default_audio_sample_t gain, jack_default_audio_sample_t step,
+                          jack_nframes_t nframes) {
+    jack_nframes_t fidx;
+    for(fidx=0; fidx<nframes; fidx++) {
+        out[fidx] += in[fidx] * (gain + step * (jack_default_audio_sample_t)(fidx + 1));
+    }
+}
+
+/* one input into four outputs at once, so each input sample is loaded once
+ * per four outputs; overwrites the outputs unless accumulate is set */
+JACK_GAIN_SIMD_CLONES
+void gain_kernel_mix4(jack_default_audio_sample_t * restrict out0,
+                      jack_default_audio_sample_t * restrict out1,
+                      jack_default_audio_sample_t * restrict out2,
+                      jack_default_audio_sample_t * restrict out3,
+                      const jack_default_audio_sample_t * restrict in,
+                      const jack_default_audio_sample_t *gains,
+                      bool accumulate, jack_nframes_t nframes) {
+    jack_default_audio_sample_t g0 = gains[0], g1 = gains[1], g2 = gains[2], g3 = gains[3];
+    jack_nframes_t fidx;
+    if(accumulate) {
+        for(fidx=0; fidx<nframes; fidx++) {
+            jack_default_audio_sample_t x = in[fidx];
+            out0[fidx] += x * g0;
+            out1[fidx] += x * g1;
+            out2[fidx] += x * g2;
+            out3[fidx] += x * g3;
+        }
+    }
+    else {
+        for(fidx=0; fidx<nframes; fidx++) {
+            jack_default_audio_sample_t x = in[fidx];
+            out0[fidx] = x * g0;
+            out1[fidx] = x * g1;
+            out2[fidx] = x * g2;
+            out3[fidx] = x * g3;
+        }
+    }
+}
+
+/* peak and sum of squares of one block.  The peak is the max of the
+ * samples' magnitude bits as integers, which orders the same as the floats
+ * but vectorizes without relaxing float semantics, and the sum of squares
+ * keeps eight partial sums for the same reason. */
+#define METER_LANES (8)
+typedef uint32_t __attribute__((may_alias)) meter_bits_t;
+JACK_GAIN_SIMD_CLONES
+void meter_kernel_peak_sumsq(const jack_default_audio_sample_t * restrict buf,
+                             jack_nframes_t nframes, float *peak, double *sumsq) {
+    const meter_bits_t *bits = (const meter_bits_t *)buf;
+    uint32_t peakbits = 0, abits;
+    float sums[METER_LANES] = {0.0f}, blockpeak;
+    jack_nframes_t fidx, lidx, nfull = nframes - (nframes % METER_LANES);
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        abits = bits[fidx] & 0x7fffffffu;
+        peakbits = abits > peakbits ? abits : peakbits;
+    }
+    for(fidx=0; fidx<nfull; fidx+=METER_LANES) {
+        for(lidx=0; lidx<METER_LANES; lidx++) {
+            sums[lidx] += buf[fidx + lidx] * buf[fidx + lidx];
+        }
+    }
+    for(; fidx<nframes; fidx++) {
+        sums[0] += buf[fidx] * buf[fidx];
+    }
+
+    memcpy(&blockpeak, &peakbits, sizeof(blockpeak));
+    *(peak) = blockpeak > *(peak) ? blockpeak : *(peak);
+    for(lidx=0; lidx<METER_LANES; lidx++) {
+        *(sumsq) += (double)sums[lidx];
+    }
+}
+
+/* apply one gain to one port, picking the cheapest way to do it */
+static inline void apply_gain(jack_default_audio_sample_t *out,
+                              jack_default_audio_sample_t *in,
+                              jack_default_audio_sample_t gain, jack_nframes_t nframes) {
+    if(gain == 0.0f) {
+        memset(out, 0, sizeof(jack_default_audio_sample_t) * nframes);
+    }
+    else if(gain == 1.0f) {
+        if(out != in) {
+            memcpy(out, in, sizeof(jack_default_audio_sample_t) * nframes);
+        }
+    }
+    else if(out == in) {
+        // JACK may hand us the same buffer for in and out
+        gain_kernel_inplace(out, gain, nframes);
+    }
+    else {
+        gain_kernel_copy(out, in, gain, nframes);
+    }
+}
+
+/* set up ramps from cur_gains to a freshly published bank of gains */
+static void start_ramps(const gain_bank_t *bank) {
+    int cidx;
+    for(cidx=0; cidx<jackchans; cidx++) {
+        jack_default_audio_sample_t from = cur_gains[cidx];
+        jack_default_audio_sample_t to = bank->gains[cidx];
+        jack_nframes_t ramp_nframes = bank->ramp_nframes[cidx];
+        target_gains[cidx] = to;
+        if(from == to || ramp_nframes == 0) {
+            cur_gains[cidx] = to;
+            ramp_remaining[cidx] = 0;
+        }
+        else if(ramp_shape == JACK_GAIN_RAMP_EXPONENTIAL && from > 0.0f && to > 0.0f) {
+            // constant ratio per segment, i.e. a straight line in dB
+            jack_nframes_t nsegs = (ramp_nframes + JACK_GAIN_RAMP_SEGMENT - 1) / JACK_GAIN_RAMP_SEGMENT;
+            ramp_shapes[cidx] = JACK_GAIN_RAMP_EXPONENTIAL;
+            ramp_steps[cidx] = powf(to / from, 1.0f / (float)nsegs);
+            ramp_remaining[cidx] = nsegs * JACK_GAIN_RAMP_SEGMENT;
+            seg_gains[cidx] = from;
+        }
+        else {
+            // linear, also used for exp ramps to or from silence
+            ramp_shapes[cidx] = JACK_GAIN_RAMP_LINEAR;
+            ramp_steps[cidx] = (to - from) / (jack_default_audio_sample_t)ramp_nframes;
+            ramp_remaining[cidx] = ramp_nframes;
+        }
+    }
+}
+
+/* run nframes (<= ramp_remaining) of the current ramp for one channel */
+static void run_ramp(int cidx, jack_default_audio_sample_t *out,
+                     jack_default_audio_sample_t *in, jack_nframes_t nframes) {
+    jack_nframes_t fidx = 0, left;
+
+    if(ramp_shapes[cidx] == JACK_GAIN_RAMP_LINEAR) {
+        apply_linear_ramp(out, in, cur_gains[cidx], ramp_steps[cidx], nframes);
+        ramp_remaining[cidx] -= nframes;
+        cur_gains[cidx] += ramp_steps[cidx] * (jack_default_audio_sample_t)nframes;
+    }
+    else {
+        // piecewise linear, each segment ending a fixed ratio above its start
+        jack_default_audio_sample_t seg_step;
+        while(fidx < nframes) {
+            left = ramp_remaining[cidx] % JACK_GAIN_RAMP_SEGMENT;
+            left = left ? left : JACK_GAIN_RAMP_SEGMENT;
+            seg_step = seg_gains[cidx] * (ramp_steps[cidx] - 1.0f) / JACK_GAIN_RAMP_SEGMENT;
+            jack_nframes_t n = left < nframes - fidx ? left : nframes - fidx;
+            jack_default_audio_sample_t gain = seg_gains[cidx] +
+                seg_step * (jack_default_audio_sample_t)(JACK_GAIN_RAMP_SEGMENT - left);
+            apply_linear_ramp(out + fidx, in + fidx, gain, seg_step, n);
+            ramp_remaining[cidx] -= n;
+            cur_gains[cidx] = gain + seg_step * (jack_default_audio_sample_t)n;
+            if(n == left) {
+                seg_gains[cidx] *= ramp_steps[cidx];
+            }
+            fidx += n;
+        }
+    }
+
+    if(ramp_remaining[cidx] == 0) {
+        cur_gains[cidx] = target_gains[cidx];
+    }
+}
+
+/* K-weighting filter coefficients for the jack sample rate (ITU-R BS.1770,
+ * with the pre-filter and RLB high-pass re-derived for rates other than 48k) */
+void meter_setup_kweighting(double samplerate) {
+    double f0, G, Q, K, Vh, Vb, a0;
+
+    // stage 1, high shelf
+    f0 = 1681.974450955533;
+    G = 3.999843853973347;
+    Q = 0.7071752369554196;
+    K = tan(M_PI * f0 / samplerate);
+    Vh = pow(10.0, G / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / Q + K * K;
+    kweight_b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+    kweight_b[0][1] = 2.0 * (K * K - Vh) / a0;
+    kweight_b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+    kweight_a[0][0] = 1.0;
+    kweight_a[0][1] = 2.0 * (K * K - 1.0) / a0;
+    kweight_a[0][2] = (1.0 - K / Q + K * K) / a0;
+
+    // stage 2, high pass
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / samplerate);
+    a0 = 1.0 + K / Q + K * K;
+    kweight_b[1][0] = 1.0;
+    kweight_b[1][1] = -2.0;
+    kweight_b[1][2] = 1.0;
+    kweight_a[1][0] = 1.0;
+    kweight_a[1][1] = 2.0 * (K * K - 1.0) / a0;
+    kweight_a[1][2] = (1.0 - K / Q + K * K) / a0;
+}
+
+/* sum of squares of one block through the K-weighting filter */
+static double meter_kweighted_sumsq(int cidx, const jack_default_audio_sample_t *buf,
+                                    jack_nframes_t nframes) {
+    double (*st)[2] = kweight_states[cidx];
+    double sum = 0.0, x, y;
+    jack_nframes_t fidx;
+    int stage;
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        x = (double)buf[fidx];
+        for(stage=0; stage<2; stage++) {
+            // transposed direct form II
+            y = kweight_b[stage][0] * x + st[stage][0];
+            st[stage][0] = kweight_b[stage][1] * x - kweight_a[stage][1] * y + st[stage][1];
+            st[stage][1] = kweight_b[stage][2] * x - kweight_a[stage][2] * y;
+            x = y;
+        }
+        sum += x * x;
+    }
+    return sum;
+}
+
+/* fold one block of outputs into the open interval, and hand the interval
+ * to meter_thread once it spans METER_INTERVAL_MSECS */
+static void meter_process(jack_default_audio_sample_t **bufs, int nchans, jack_nframes_t nframes) {
+    int cidx;
+    for(cidx=0; cidx<nchans; cidx++) {
+        meter_kernel_peak_sumsq(bufs[cidx], nframes, &(meter_open.peaks[cidx]), &(meter_open.sumsqs[cidx]));
+        meter_open.ksumsqs[cidx] += meter_kweighted_sumsq(cidx, bufs[cidx], nframes);
+    }
+    meter_open.nframes += nframes;
+
+    if(meter_open.nframes >= meter_interval_nframes) {
+        while(atomic_load_explicit(&freewheeling, memory_order_acquire) &&
+              PaUtil_GetRingBufferWriteAvailable(&meter_ringbuf) < 1) {
+            jc_handoff_post(&meter_wake);
+            if(jc_handoff_wait(&meter_consumed, METER_STALL_USECS)) {
+                break; // meter_thread is stuck, drop this one after all
+            }
+        }
+        if(PaUtil_WriteRingBuffer(&meter_ringbuf, &meter_open, 1) != 1) {
+            atomic_fetch_add_explicit(&meter_dropped, 1, memory_order_relaxed);
+        }
+        memset(&meter_open, 0, sizeof(meter_open));
+    }
+}
+
+/* drop inaudible routes, list the live ones and decide sparse vs dense */
+void compile_matrix(gain_matrix_t *m) {
+    int oidx, iidx, total = 0;
+    for(oidx=0; oidx<m->nout; oidx++) {
+        m->nroutes[oidx] = 0;
+        for(iidx=0; iidx<m->nin; iidx++) {
+            if(fabsf(m->gains[oidx][iidx]) < JACK_GAIN_MIN_LINEAR) {
+                m->gains[oidx][iidx] = 0.0f;
+            }
+            else {
+                m->route_ins[oidx][m->nroutes[oidx]++] = iidx;
+            }
+        }
+        total += m->nroutes[oidx];
+    }
+    m->dense = (float)total > JACK_GAIN_DENSE_FRACTION * (float)(m->nin * m->nout);
+}
+
+/* set up a ramp of every route from the current gains to a new matrix */
+static void start_matrix_ramp(const gain_matrix_t *next) {
+    const gain_matrix_t *from = matrix_ramp_remaining > 0 ? &ramp_matrix : &rt_matrix;
+    int oidx, iidx;
+
+    if(ramp_nframes == 0) {
+        rt_matrix = *next;
+        matrix_ramp_remaining = 0;
+        return;
+    }
+
+    ramp_matrix.nin = next->nin;
+    ramp_matrix.nout = next->nout;
+    for(oidx=0; oidx<next->nout; oidx++) {
+        ramp_matrix.nroutes[oidx] = 0;
+        for(iidx=0; iidx<next->nin; iidx++) {
+            jack_default_audio_sample_t g0 = from->gains[oidx][iidx];
+            jack_default_audio_sample_t g1 = next->gains[oidx][iidx];
+            ramp_matrix.gains[oidx][iidx] = g0;
+            matrix_steps[oidx][iidx] = (g1 - g0) / (jack_default_audio_sample_t)ramp_nframes;
+            if(g0 != 0.0f || g1 != 0.0f) {
+                ramp_matrix.route_ins[oidx][ramp_matrix.nroutes[oidx]++] = iidx;
+            }
+        }
+    }
+    rt_matrix = *next;
+    matrix_ramp_remaining = ramp_nframes;
+}
+
+static void mix_ramp(jack_default_audio_sample_t **ins, jack_default_audio_sample_t **outs,
+                     jack_nframes_t nframes) {
+    gain_matrix_t *m = &ramp_matrix;
+    int oidx, ridx, iidx;
+    for(oidx=0; oidx<m->nout; oidx++) {
+        if(m->nroutes[oidx] == 0) {
+            memset(outs[oidx], 0, sizeof(jack_default_audio_sample_t) * nframes);
+            continue;
+        }
+        for(ridx=0; ridx<m->nroutes[oidx]; ridx++) {
+            iidx = m->route_ins[oidx][ridx];
+            if(ridx == 0) {
+                gain_kernel_ramp_copy(outs[oidx], ins[iidx], m->gains[oidx][iidx],
+                                      matrix_steps[oidx][iidx], nframes);
+            }
+            else {
+                gain_kernel_ramp_mac(outs[oidx], ins[iidx], m->gains[oidx][iidx],
+                                     matrix_steps[oidx][iidx], nframes);
+            }
+            m->gains[oidx][iidx] += matrix_steps[oidx][iidx] * (jack_default_audio_sample_t)nframes;
+        }
+    }
+}
+
+static void mix_sparse(const gain_matrix_t *m, jack_default_audio_sample_t **ins,
+                       jack_default_audio_sample_t **outs, jack_nframes_t offset,
+                       jack_nframes_t nframes) {
+    int oidx, ridx, iidx;
+    for(oidx=0; oidx<m->nout; oidx++) {
+        jack_default_audio_sample_t *out = outs[oidx] + offset;
+        if(m->nroutes[oidx] == 0) {
+            memset(out, 0, sizeof(jack_default_audio_sample_t) * nframes);
+            continue;
+        }
+        iidx = m->route_ins[oidx][0];
+        apply_gain(out, ins[iidx] + offset, m->gains[oidx][iidx], nframes);
+        for(ridx=1; ridx<m->nroutes[oidx]; ridx++) {
+            iidx = m->route_ins[oidx][ridx];
+            gain_kernel_mac(out, ins[iidx] + offset, m->gains[oidx][iidx], nframes);
+        }
+    }
+}
+
+static void mix_dense(const gain_matrix_t *m, jack_default_audio_sample_t **ins,
+                      jack_default_audio_sample_t **outs, jack_nframes_t offset,
+                      jack_nframes_t nframes) {
+    jack_default_audio_sample_t gains4[4];
+    int oidx, iidx;
+
+    // blocks of four outputs, walking every input once per block
+    for(oidx=0; oidx+4<=m->nout; oidx+=4) {
+        for(iidx=0; iidx<m->nin; iidx++) {
+            gains4[0] = m->gains[oidx+0][iidx];
+            gains4[1] = m->gains[oidx+1][iidx];
+            gains4[2] = m->gains[oidx+2][iidx];
+            gains4[3] = m->gains[oidx+3][iidx];
+            gain_kernel_mix4(outs[oidx+0] + offset, outs[oidx+1] + offset,
+                             outs[oidx+2] + offset, outs[oidx+3] + offset,
+                             ins[iidx] + offset, gains4, iidx > 0, nframes);
+        }
+    }
+    // leftover outputs one at a time
+    for(; oidx<m->nout; oidx++) {
+        gain_kernel_copy(outs[oidx] + offset, ins[0] + offset, m->gains[oidx][0], nframes);
+        for(iidx=1; iidx<m->nin; iidx++) {
+            gain_kernel_mac(outs[oidx] + offset, ins[iidx] + offset, m->gains[oidx][iidx], nframes);
+        }
+    }
+}
+
+/* matrix mode's work on frames [offset, offset + nframes) of the ports'
+ * buffers, nframes at most JACK_GAIN_MAX_FRAMES */
+static void process_matrix_block(jack_default_audio_sample_t *const *port_ins,
+                                 jack_default_audio_sample_t *const *port_outs,
+                                 jack_nframes_t offset, jack_nframes_t nframes) {
+    jack_default_audio_sample_t *ins[JACK_GAIN_MAX_PORTS];
+    jack_default_audio_sample_t *outs[JACK_GAIN_MAX_PORTS];
+    jack_nframes_t ndone = 0;
+    int iidx, oidx;
+
+    for(iidx=0; iidx<rt_matrix.nin; iidx++) {
+        ins[iidx] = port_ins[iidx] + offset;
+    }
+    for(oidx=0; oidx<rt_matrix.nout; oidx++) {
+        outs[oidx] = port_outs[oidx] + offset;
+    }
+
+    // outputs are written while other outputs still read the inputs, so
+    // set aside any input that JACK gave the same buffer as an output
+    for(iidx=0; iidx<rt_matrix.nin; iidx++) {
+        for(oidx=0; oidx<rt_matrix.nout; oidx++) {
+            if(ins[iidx] == outs[oidx]) {
+                memcpy(matrix_scratch[iidx], ins[iidx], sizeof(jack_default_audio_sample_t) * nframes);
+                ins[iidx] = matrix_scratch[iidx];
+                break;
+            }
+        }
+    }
+
+    if(matrix_ramp_remaining > 0) {
+        ndone = nframes < matrix_ramp_remaining ? nframes : matrix_ramp_remaining;
+        mix_ramp(ins, outs, ndone);
+        matrix_ramp_remaining -= ndone;
+    }
+    if(ndone < nframes) {
+        if(rt_matrix.dense) {
+            mix_dense(&rt_matrix, ins, outs, ndone, nframes - ndone);
+        }
+        else {
+            mix_sparse(&rt_matrix, ins, outs, ndone, nframes - ndone);
+        }
+    }
+
+    if(meter_enabled) {
+        meter_process(outs, rt_matrix.nout, nframes);
+    }
+    if(delay_nframes > 0) {
+        for(oidx=0; oidx<rt_matrix.nout; oidx++) {
+            jc_delay_process(&(delays[oidx]), outs[oidx], outs[oidx], nframes);
+        }
+    }
+}
+
+/* the process callback's work in matrix mode, in blocks that fit
+ * matrix_scratch, so an input sharing an output's buffer is always set
+ * aside before it's overwritten */
+static int process_matrix(jack_nframes_t nframes) {
+    jack_default_audio_sample_t *ins[JACK_GAIN_MAX_PORTS];
+    jack_default_audio_sample_t *outs[JACK_GAIN_MAX_PORTS];
+    jack_nframes_t offset, block;
+    int iidx, oidx;
+
+    for(iidx=0; iidx<rt_matrix.nin; iidx++) {
+        ins[iidx] = jack_port_get_buffer(jackin_ports[iidx], nframes);
+    }
+    for(oidx=0; oidx<rt_matrix.nout; oidx++) {
+        outs[oidx] = jack_port_get_buffer(jackout_ports[oidx], nframes);
+    }
+
+    // pick up a newly published matrix, if any
+    unsigned int seq = atomic_load_explicit(&gain_bank_seq, memory_order_acquire);
+    if(seq != seen_bank_seq) {
+        start_matrix_ramp(&(matrix_banks[seq & 1]));
+        seen_bank_seq = seq;
+        atomic_store_explicit(&gain_bank_ack, seq, memory_order_release);
+    }
+
+    for(offset=0; offset<nframes; offset+=block) {
+        block = nframes - offset < JACK_GAIN_MAX_FRAMES ? nframes - offset : JACK_GAIN_MAX_FRAMES;
+        process_matrix_block(ins, outs, offset, block);
+    }
+
+    return 0;
+}
+
 /**
  * The process callback for this JACK application is called in a
  * special realtime thread once for each audio cycle.
@@ -47,20 +688,51 @@ int
 jack_process (jack_nframes_t nframes, void *arg)
 {
     int cidx;
-    jack_nframes_t fidx;
-    jack_default_audio_sample_t *jackbufIN;
-    jack_default_audio_sample_t *jackbufOUT;
+    jack_default_audio_sample_t *jackbufsIN[JACK_GAIN_MAX_PORTS];
+    jack_default_audio_sample_t *jackbufsOUT[JACK_GAIN_MAX_PORTS];
     
     // silence compiler
     arg = arg;
-    
+
+    if(matrix_mode) {
+        return process_matrix(nframes);
+    }
+
+    // fetch all port buffers first, then run the kernels back to back
     for(cidx=0; cidx<jackchans; cidx++) {
-        jackbufIN = jack_port_get_buffer(jackin_ports[cidx], nframes);
-        jackbufOUT = jack_port_get_buffer(jackout_ports[cidx], nframes);
-        for(fidx=0; fidx<nframes; fidx++) {
-            *(jackbufOUT++) = *(jackbufIN++) * linear_gains[cidx];
+        jackbufsIN[cidx] = jack_port_get_buffer(jackin_ports[cidx], nframes);
+        jackbufsOUT[cidx] = jack_port_get_buffer(jackout_ports[cidx], nframes);
+    }
+    // pick up newly published gains, if any
+    unsigned int seq = atomic_load_explicit(&gain_bank_seq, memory_order_acquire);
+    if(seq != seen_bank_seq) {
+        start_ramps(&(gain_banks[seq & 1]));
+        seen_bank_seq = seq;
+        atomic_store_explicit(&gain_bank_ack, seq, memory_order_release);
+    }
+
+    for(cidx=0; cidx<jackchans; cidx++) {
+        jack_default_audio_sample_t *in = jackbufsIN[cidx];
+        jack_default_audio_sample_t *out = jackbufsOUT[cidx];
+        jack_nframes_t ndone = 0;
+
+        if(ramp_remaining[cidx] > 0) {
+            ndone = nframes < ramp_remaining[cidx] ? nframes : ramp_remaining[cidx];
+            run_ramp(cidx, out, in, ndone);
+        }
+        if(ndone < nframes) {
+            apply_gain(out + ndone, in + ndone, cur_gains[cidx], nframes - ndone);
         }
-    } // end PLAY_MODE
+    }
+
+    if(meter_enabled) {
+        meter_process(jackbufsOUT, jackchans, nframes);
+    }
+    if(delay_nframes > 0) {
+        for(cidx=0; cidx<jackchans; cidx++) {
+            jc_delay_process(&(delays[cidx]), jackbufsOUT[cidx], jackbufsOUT[cidx], nframes);
+        }
+    }
 
     return 0;
 }
@@ -68,6 +740,42 @@ jack_process (jack_nframes_t nframes, void *arg)
 
 
 
+/**
+ * With -j or -S, JACK calls this when freewheeling starts or stops; while
+ * it lasts meter_process may wait for meter_thread instead of dropping.
+ */
+void jack_freewheel(int starting, void *arg) {
+    arg = arg; // silence compiler
+    atomic_store_explicit(&freewheeling, starting != 0, memory_order_release);
+    jc_handoff_post(&meter_wake);
+}
+
+/**
+ * With -a, JACK calls this to work out latencies through the graph: every
+ * path through us is delay_nframes longer than the ports on the far side.
+ */
+void jack_latency(jack_latency_callback_mode_t mode, void *arg) {
+    jack_latency_range_t range, widest = {UINT32_MAX, 0};
+    jack_port_t **from = mode == JackCaptureLatency ? jackin_ports : jackout_ports;
+    jack_port_t **to = mode == JackCaptureLatency ? jackout_ports : jackin_ports;
+    int nin = matrix_mode ? matrix.nin : jackchans, nout = matrix_mode ? matrix.nout : jackchans;
+    int nfrom = mode == JackCaptureLatency ? nin : nout, nto = mode == JackCaptureLatency ? nout : nin;
+    int pidx;
+
+    arg = arg; // silence compiler
+
+    for(pidx=0; pidx<nfrom; pidx++) {
+        jack_port_get_latency_range(from[pidx], mode, &range);
+        widest.min = range.min < widest.min ? range.min : widest.min;
+        widest.max = range.max > widest.max ? range.max : widest.max;
+    }
+    widest.min = (nfrom > 0 ? widest.min : 0) + delay_nframes;
+    widest.max += delay_nframes;
+    for(pidx=0; pidx<nto; pidx++) {
+        jack_port_set_latency_range(to[pidx], mode, &widest);
+    }
+}
+
 /**
  * JACK calls this shutdown_callback if the server ever shuts down or
  * decides to disconnect the client.
@@ -79,69 +787,301 @@ jack_shutdown (void *arg)
     exit (1);
 }
 
-#define CHARBUF_1FLOAT_LEN (128)
 enum jack_gain_error_flag{
     JACK_GAIN_NOERROR,
     JACK_GAIN_UNKNOWN_ERROR,
     JACK_GAIN_FILEREAD_ERROR,
     JACK_GAIN_USAGE_ERROR, 
-    JACK_GAIN_ZEROCHANS_ERROR };
+    JACK_GAIN_ZEROCHANS_ERROR,
+    JACK_GAIN_SHAPE_ERROR,
+    JACK_GAIN_SHM_ERROR,
+    JACK_GAIN_PARSE_ERROR,
+    JACK_GAIN_RANGE_ERROR };
 
-int set_gains_from_file(char *fname, int mode, int *chans, 
-                        jack_default_audio_sample_t *dbs, 
-                        jack_default_audio_sample_t *lins) {
-    char charbuf_1float[CHARBUF_1FLOAT_LEN];
-    char *cb1ptr = &(charbuf_1float[0]);
-    int chanidx=0, c;
-    float afloat;
-    FILE *file;
-
-    file = fopen(fname, "r");
-    if (file) {
-        while(chanidx < JACK_GAIN_MAX_PORTS) {
-            c = getc(file);
-            if( EOF == c ) {
-                if( 0 == chanidx) {
-                    *(chans) = 0;
-                    return JACK_GAIN_ZEROCHANS_ERROR;
-                }
-                else {
-                    *(chans) = chanidx; // after parsing, index=count
-                    return JACK_GAIN_NOERROR;
-                }
-            }
-            // if it's a number or dot, put it in charbuf_1float
-            else if( (0x30 <= c && c <= 0x39) || c==0x2E || c==0x2D) {
-                *(cb1ptr++) = c;
-            }
-            else{
-                *(cb1ptr++) = 0; // null terminate
-                cb1ptr = &(charbuf_1float[0]);
-                if(0==strlen(cb1ptr)) {
-                    continue;
-                }
-
-                sscanf(charbuf_1float, "%f", &afloat);
-                printf("-->%s<-- : %.3f\n", cb1ptr, afloat);
-
-                if( mode == JACK_GAIN_DB_MODE ) {
-                    dbs[chanidx] = (jack_default_audio_sample_t)(afloat);
-                    lins[chanidx] = (jack_default_audio_sample_t)(pow(10.0f, afloat / 20.0f));
-                }
-                else if( mode == JACK_GAIN_LINEAR_MODE ){
-                    lins[chanidx] = (jack_default_audio_sample_t)(afloat);
-                    dbs[chanidx] = (jack_default_audio_sample_t)(20.0 * log10(afloat));
-                }
-                chanidx++; // increment channel index/count
+/* gain file parsing
+ *
+ * Gain files are mapped whole and split into tokens at whitespace and
+ * commas, with everything from '#' to the end of a line a comment.  A token
+ * is a value, or N=value to address channel (or matrix column) N counting
+ * from 1; values without N= go to the channel after the previous one.  A
+ * value is a number with an optional dB or x (linear) suffix, defaulting to
+ * the unit of the option that named the file, and -inf mutes.  In per
+ * channel gain files a value may end in @20ms or @0.02s to ramp that
+ * channel at its own speed instead of -t's.
+ */
+#define GAIN_TOKEN_LEN (64)
+#define JACK_GAIN_MAX_DB (60.0f) // reject anything louder, likely a typo
+#define JACK_GAIN_MAX_RAMP_MSECS (60000.0f)
+
+typedef struct gain_scanner {
+    const char *p, *end;
+    const char *fname;
+    int line;
+} gain_scanner_t;
+
+/* map a whole file read-only, returns NULL on error; an empty file maps
+ * to a non-NULL pointer with *len 0 */
+const char *map_gain_file(const char *fname, size_t *len) {
+    static const char empty = 0;
+    struct stat st;
+    void *mem;
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+    *(len) = (size_t)st.st_size;
+    if(*(len) == 0) {
+        close(fd);
+        return &empty;
+    }
+    mem = mmap(NULL, *(len), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return mem == MAP_FAILED ? NULL : (const char *)mem;
+}
+
+void unmap_gain_file(const char *mem, size_t len) {
+    if(len > 0) {
+        munmap((void *)mem, len);
+    }
+}
+
+/* find the next token, counting the newlines skipped to reach it in
+ * *nlines; returns its length, or 0 at the end of the file */
+size_t next_gain_token(gain_scanner_t *sc, const char **tok, int *nlines) {
+    *(nlines) = 0;
+    while(sc->p < sc->end) {
+        char c = *(sc->p);
+        if(c == '#') {
+            while(sc->p < sc->end && *(sc->p) != '\n') {
+                sc->p++;
             }
         }
+        else if(c == '\n') {
+            *(nlines) += 1;
+            sc->line++;
+            sc->p++;
+        }
+        else if(isspace((unsigned char)c) || c == ',') {
+            sc->p++;
+        }
+        else {
+            break;
+        }
+    }
+
+    *(tok) = sc->p;
+    while(sc->p < sc->end && !isspace((unsigned char)*(sc->p)) &&
+          *(sc->p) != ',' && *(sc->p) != '#') {
+        sc->p++;
+    }
+    return (size_t)(sc->p - *(tok));
+}
+
+/* parse one value, e.g. "-6", "-6dB", "0.5x" or "-inf", with an optional
+ * "@20ms" ramp when ramp_msecs isn't NULL (left alone without one) */
+int parse_gain_value(const char *tok, size_t len, int mode,
+                     jack_default_audio_sample_t *db, jack_default_audio_sample_t *lin,
+                     float *ramp_msecs) {
+    char buf[GAIN_TOKEN_LEN];
+    char *unit, *at, *end;
+    float value, ramp;
+
+    if(len == 0 || len >= GAIN_TOKEN_LEN) {
+        return JACK_GAIN_PARSE_ERROR;
+    }
+    memcpy(buf, tok, len);
+    buf[len] = 0;
+
+    at = strchr(buf, '@');
+    if(at) {
+        if(!ramp_msecs) {
+            return JACK_GAIN_PARSE_ERROR;
+        }
+        *(at++) = 0;
+        ramp = strtof(at, &end);
+        if(end == at) {
+            return JACK_GAIN_PARSE_ERROR;
+        }
+        if(0 == strcasecmp(end, "s")) {
+            ramp *= 1000.0f;
+        }
+        else if(0 != strcasecmp(end, "ms")) {
+            return JACK_GAIN_PARSE_ERROR;
+        }
+        if(!(ramp >= 0.0f && ramp <= JACK_GAIN_MAX_RAMP_MSECS)) {
+            return JACK_GAIN_RANGE_ERROR;
+        }
+        *(ramp_msecs) = ramp;
+    }
+
+    value = strtof(buf, &unit);
+    if(unit == buf || isnan(value)) {
+        return JACK_GAIN_PARSE_ERROR;
+    }
+    if(0 == strcasecmp(unit, "db")) {
+        mode = JACK_GAIN_DB_MODE;
+    }
+    else if(0 == strcasecmp(unit, "x")) {
+        mode = JACK_GAIN_LINEAR_MODE;
+    }
+    else if(*unit != 0) {
+        return JACK_GAIN_PARSE_ERROR;
+    }
+
+    if( mode == JACK_GAIN_DB_MODE ) {
+        if(value > JACK_GAIN_MAX_DB) {
+            return JACK_GAIN_RANGE_ERROR;
+        }
+        *(db) = (jack_default_audio_sample_t)(value);
+        *(lin) = isinf(value) ? 0.0f : (jack_default_audio_sample_t)(pow(10.0f, value / 20.0f));
+    }
+    else {
+        // -inf mutes here too, as it would in dB
+        if(isinf(value) && value < 0.0f) {
+            *(lin) = 0.0f;
+            *(db) = -INFINITY;
+            return JACK_GAIN_NOERROR;
+        }
+        // negative linear gains flip polarity, their dB is of the magnitude
+        if(isinf(value) || fabsf(value) > powf(10.0f, JACK_GAIN_MAX_DB / 20.0f)) {
+            return JACK_GAIN_RANGE_ERROR;
+        }
+        *(lin) = (jack_default_audio_sample_t)(value);
+        *(db) = value == 0.0f ? -INFINITY : (jack_default_audio_sample_t)(20.0 * log10(fabsf(value)));
     }
-    else{
+    return JACK_GAIN_NOERROR;
+}
+
+/* split "N=value" into N (from 1) and value, N is 0 without "=" */
+int split_gain_address(const char **tok, size_t *len, int *addr) {
+    const char *eq = memchr(*tok, '=', *len);
+    char *end;
+    long n;
+
+    *(addr) = 0;
+    if(!eq) {
+        return JACK_GAIN_NOERROR;
+    }
+    n = strtol(*tok, &end, 10);
+    if(end != eq || n < 1 || n > JACK_GAIN_MAX_PORTS) {
+        return JACK_GAIN_RANGE_ERROR;
+    }
+    *(addr) = (int)n;
+    *(len) -= (size_t)(eq + 1 - *tok);
+    *(tok) = eq + 1;
+    return JACK_GAIN_NOERROR;
+}
+
+void gain_parse_error(const gain_scanner_t *sc, const char *tok, size_t len, int err) {
+    printf("Error, %s line %d: %s '%.*s'\n", sc->fname, sc->line,
+        err == JACK_GAIN_RANGE_ERROR ? "out of range" : "could not parse",
+        (int)(len < GAIN_TOKEN_LEN ? len : GAIN_TOKEN_LEN), tok);
+}
+
+/* Parse a per channel gain file in to dbs, lins and ramps (ms, or left
+ * alone for channels without their own ramp).  Channels the file doesn't
+ * mention are left alone, and *chans is one past the highest one set. */
+int set_gains_from_file(char *fname, int mode, int *chans, 
+                        jack_default_audio_sample_t *dbs, 
+                        jack_default_audio_sample_t *lins,
+                        float *ramps) {
+    gain_scanner_t sc;
+    const char *mem, *tok;
+    size_t memlen, len;
+    int chanidx=0, nlines, addr, ret = JACK_GAIN_NOERROR;
+
+    mem = map_gain_file(fname, &memlen);
+    if (!mem) {
         return JACK_GAIN_FILEREAD_ERROR; // send error code
     }
-    
-    // if we get here, it's unclear how we get here...
-    return JACK_GAIN_UNKNOWN_ERROR;
+    sc.p = mem;
+    sc.end = mem + memlen;
+    sc.fname = fname;
+    sc.line = 1;
+
+    *(chans) = 0;
+    while((len = next_gain_token(&sc, &tok, &nlines)) > 0) {
+        ret = split_gain_address(&tok, &len, &addr);
+        chanidx = addr > 0 ? addr - 1 : chanidx;
+        if(!ret && chanidx >= JACK_GAIN_MAX_PORTS) {
+            ret = JACK_GAIN_RANGE_ERROR;
+        }
+        if(!ret) {
+            ret = parse_gain_value(tok, len, mode, &(dbs[chanidx]), &(lins[chanidx]), &(ramps[chanidx]));
+        }
+        if(ret) {
+            gain_parse_error(&sc, tok, len, ret);
+            break;
+        }
+        chanidx++; // increment channel index/count
+        *(chans) = chanidx > *(chans) ? chanidx : *(chans);
+    }
+    unmap_gain_file(mem, memlen);
+
+    if(ret) {
+        return ret;
+    }
+    return *(chans) == 0 ? JACK_GAIN_ZEROCHANS_ERROR : JACK_GAIN_NOERROR;
+}
+
+/* Like set_gains_from_file, but each line of the file is one output and
+ * holds the gains from each input to that output, N= picking the input.
+ * Missing gains are zero, and the widest row sets the number of inputs. */
+int set_matrix_from_file(char *fname, int mode, gain_matrix_t *m) {
+    gain_scanner_t sc;
+    const char *mem, *tok;
+    size_t memlen, len;
+    int oidx=-1, iidx=0, nlines, addr, ret = JACK_GAIN_NOERROR;
+    jack_default_audio_sample_t db;
+
+    mem = map_gain_file(fname, &memlen);
+    if (!mem) {
+        return JACK_GAIN_FILEREAD_ERROR;
+    }
+    sc.p = mem;
+    sc.end = mem + memlen;
+    sc.fname = fname;
+    sc.line = 1;
+
+    memset(m, 0, sizeof(gain_matrix_t));
+    while((len = next_gain_token(&sc, &tok, &nlines)) > 0) {
+        if(oidx < 0 || nlines > 0) {
+            // first value on a new line starts the next output's row
+            oidx++;
+            iidx = 0;
+        }
+        ret = split_gain_address(&tok, &len, &addr);
+        iidx = addr > 0 ? addr - 1 : iidx;
+        if(!ret && (oidx >= JACK_GAIN_MAX_PORTS || iidx >= JACK_GAIN_MAX_PORTS)) {
+            ret = JACK_GAIN_SHAPE_ERROR;
+        }
+        if(!ret) {
+            ret = parse_gain_value(tok, len, mode, &db, &(m->gains[oidx][iidx]), NULL);
+        }
+        if(ret) {
+            gain_parse_error(&sc, tok, len, ret);
+            break;
+        }
+        iidx++;
+        m->nin = iidx > m->nin ? iidx : m->nin;
+    }
+    unmap_gain_file(mem, memlen);
+
+    if(ret) {
+        return ret;
+    }
+    m->nout = oidx + 1;
+    if(m->nin == 0) {
+        return JACK_GAIN_ZEROCHANS_ERROR;
+    }
+    compile_matrix(m);
+    return JACK_GAIN_NOERROR;
 }
 
 void usage(void) {
@@ -151,85 +1091,492 @@ void usage(void) {
     printf("  -c,    specify the number of channels\n");
     printf("  -d,    specify the dB gain\n");
     printf("  -l,    specify the linear gain\n");
-    printf("  -D,    specify the dB gain file of floats, delimited by not [0123456789.]\n");
-    printf("  -L,    specify the linear gain file of floats, delimited by not [0123456789.]\n");
+    printf("  -D,    specify a gain file, with values in dB unless they say otherwise\n");
+    printf("  -L,    specify a gain file, with linear values unless they say otherwise\n");
+    printf("  -m,    specify a linear gain matrix file, one line per output, one column\n");
+    printf("         per input; ports follow the matrix shape and -c is ignored\n");
+    printf("  -M,    specify a dB gain matrix file, as -m\n");
     printf("  -n,    specify the name of the jack client\n");
+    printf("  -t,    specify the ramp time in ms for gain changes, default=20\n");
+    printf("  -x,    ramp gain changes exponentially (linear in dB) instead of linearly\n");
+    printf("  -j,    meter the outputs, printing a json line of peak, rms and EBU R128\n");
+    printf("         loudness to stdout every J ms\n");
+    printf("  -S,    meter the outputs into POSIX shared memory named S, laid out as in\n");
+    printf("         jack_gain_meter.h, updated every J ms (default 100)\n");
+    printf("  -a,    delay the outputs by A ms, reported to jack as latency; the\n");
+    printf("         meters see the audio A ms before it leaves, as lookahead\n");
+    printf("\n");
+    printf("  Gain files hold values separated by whitespace or commas, with # starting\n");
+    printf("  a comment.  Values go to channels in order, or to channel N as N=value.\n");
+    printf("  A value may end in dB or x (linear), -inf mutes, and in -D/-L files a\n");
+    printf("  value may end in @20ms or @0.02s to ramp that channel at its own speed:\n");
+    printf("    # two mics and a muted talkback\n");
+    printf("    -6dB, -4.5dB@200ms\n");
+    printf("    8=-inf\n");
+    printf("\n");
+    printf("  Send SIGHUP to re-read the -D/-L/-m/-M gain file while running, e.g.\n");
+    printf("    kill -HUP $(pidof jack_gain)\n");
     printf("\n\n");
 }
 
 void fyi(void) {
-    int cidx;
-    printf("\nINFO: Attempting to run jack_gain\n    where\n    channels=%d\n    client-name='%s'",
+    int cidx, oidx, iidx;
+
+    if(matrix_mode) {
+        fprintf(info_fp, "\nINFO: Attempting to run jack_gain\n    where\n    inputs=%d, outputs=%d, %s mixing\n    client-name='%s'",
+            matrix.nin, matrix.nout, matrix.dense ? "dense" : "sparse", jackname);
+        fprintf(info_fp, "\n    linear gain matrix (outputs down, inputs across) = ");
+        for(oidx=0; oidx<matrix.nout; oidx++) {
+            fprintf(info_fp, "\n        ");
+            for(iidx=0; iidx<matrix.nin; iidx++) {
+                fprintf(info_fp, "%3.3f, ", matrix.gains[oidx][iidx]);
+            }
+        }
+        fprintf(info_fp, "\n\n");
+        return;
+    }
+
+    fprintf(info_fp, "\nINFO: Attempting to run jack_gain\n    where\n    channels=%d\n    client-name='%s'",
         jackchans, jackname);
     
-    printf("\n    db_gains = ");
+    fprintf(info_fp, "\n    db_gains = ");
     for(cidx=0; cidx<jackchans; cidx++){
-        printf("%3.3f, ", db_gains[cidx]);
+        fprintf(info_fp, "%3.3f, ", db_gains[cidx]);
     }
 
-    printf("\n    linear_gains = ");
+    fprintf(info_fp, "\n    linear_gains = ");
     for(cidx=0; cidx<jackchans; cidx++){
-        printf("%3.3f, ", linear_gains[cidx]);
+        fprintf(info_fp, "%3.3f, ", linear_gains[cidx]);
     }
 
-    printf("\n\n");
+    fprintf(info_fp, "\n\n");
+}
+
+void sighup_handler(int signum) {
+    signum = signum; // silence compiler
+    reload_requested = 1;
+}
+
+/* hand src over to the jack thread through a pair of banks of
+ * size bytes each (gain_banks or matrix_banks), and the jack thread
+ * ramps to the new values */
+void publish_bank(void *banks, const void *src, size_t size) {
+    unsigned int seq = atomic_load_explicit(&gain_bank_seq, memory_order_relaxed);
+
+    // don't overwrite a bank the jack thread may not have copied yet
+    while(atomic_load_explicit(&gain_bank_ack, memory_order_acquire) != seq) {
+        usleep(1000);
+    }
+    memcpy((char *)banks + ((seq + 1) & 1) * size, src, size);
+    atomic_store_explicit(&gain_bank_seq, seq + 1, memory_order_release);
+}
+
+/* the gains and ramp lengths the jack thread should move to next */
+void fill_gain_bank(gain_bank_t *bank) {
+    int cidx;
+    for(cidx=0; cidx<JACK_GAIN_MAX_PORTS; cidx++) {
+        float msecs = ramp_msecs_chans[cidx] < 0.0f ? ramp_msecs : ramp_msecs_chans[cidx];
+        bank->gains[cidx] = linear_gains[cidx];
+        bank->ramp_nframes[cidx] = (jack_nframes_t)(msecs * 0.001f * (float)samplerate);
+    }
+}
+
+void publish_gains(void) {
+    gain_bank_t bank;
+    fill_gain_bank(&bank);
+    publish_bank(gain_banks, &bank, sizeof(bank));
+}
+
+/* re-read the -m/-M matrix file and publish it, keeping the old one on error */
+void reload_matrix(void) {
+    static gain_matrix_t next;
+    int ret;
+
+    ret = set_matrix_from_file(gain_fname, gain_fname_mode, &next);
+    if(ret) {
+        fprintf(info_fp, "WRN: error (%d) re-reading %s, keeping the current matrix\n", ret, gain_fname);
+        return;
+    }
+    if(next.nin > matrix.nin || next.nout > matrix.nout) {
+        fprintf(info_fp, "WRN: %s is now %d x %d, larger than the %d x %d ports, keeping the current matrix\n",
+            gain_fname, next.nout, next.nin, matrix.nout, matrix.nin);
+        return;
+    }
+
+    // the ports can't change, so a smaller matrix is padded with silence
+    next.nin = matrix.nin;
+    next.nout = matrix.nout;
+    compile_matrix(&next);
+    matrix = next;
+    publish_bank(matrix_banks, &matrix, sizeof(matrix));
+    fyi();
+}
+
+/* re-read the -D/-L gain file and publish it, keeping old gains on error */
+void reload_gains(void) {
+    jack_default_audio_sample_t dbs[JACK_GAIN_MAX_PORTS];
+    jack_default_audio_sample_t lins[JACK_GAIN_MAX_PORTS];
+    float ramps[JACK_GAIN_MAX_PORTS];
+    int chans = 0, ret;
+
+    if(gain_fname[0] == 0) {
+        fprintf(info_fp, "WRN: got SIGHUP, but no gain file was given with -D, -L, -m or -M\n");
+        return;
+    }
+    if(matrix_mode) {
+        reload_matrix();
+        return;
+    }
+
+    // channels missing from the file keep their current gain, and
+    // channels without a ramp time of their own go back to -t's
+    memcpy(dbs, db_gains, sizeof(db_gains));
+    memcpy(lins, linear_gains, sizeof(linear_gains));
+    for(ret=0; ret<JACK_GAIN_MAX_PORTS; ret++) {
+        ramps[ret] = -1.0f;
+    }
+    ret = set_gains_from_file(gain_fname, gain_fname_mode, &chans, &(dbs[0]), &(lins[0]), &(ramps[0]));
+    if(ret) {
+        fprintf(info_fp, "WRN: error (%d) re-reading %s, keeping the current gains\n", ret, gain_fname);
+        return;
+    }
+    if(chans != jackchans) {
+        fprintf(info_fp, "WRN: %s has %d gains for %d channels\n", gain_fname, chans, jackchans);
+    }
+
+    memcpy(db_gains, dbs, sizeof(db_gains));
+    memcpy(linear_gains, lins, sizeof(linear_gains));
+    memcpy(ramp_msecs_chans, ramps, sizeof(ramps));
+    publish_gains();
+    fyi();
+}
+
+/* meter_thread state, see meter_process for the jack thread's side */
+meter_interval_t meter_history[METER_SHORT_TERM_INTERVALS]; // newest intervals, circular
+int meter_history_len = 0, meter_history_next = 0;
+meter_interval_t meter_period; // everything since the last report
+uint64_t meter_total_nframes = 0, meter_updates = 0;
+double meter_hist_energy[METER_HIST_BINS];   // gating blocks, by loudness
+uint64_t meter_hist_count[METER_HIST_BINS];
+jack_nframes_t meter_samplerate = 0;
+jack_gain_meter_shm_t *meter_shm = NULL;
+
+double energy_to_lufs(double energy) {
+    return energy > 0.0 ? -0.691 + 10.0 * log10(energy) : -INFINITY;
+}
+
+double sumsq_to_db(double sumsq, jack_nframes_t nframes) {
+    return (sumsq > 0.0 && nframes > 0) ? 10.0 * log10(sumsq / nframes) : -INFINITY;
+}
+
+/* mean K-weighted energy over the newest nintervals intervals, for one
+ * channel or, when cidx < 0, summed over every channel */
+double meter_history_energy(int nintervals, int cidx) {
+    double ksum = 0.0;
+    jack_nframes_t nframes = 0;
+    int k, hidx, c;
+
+    nintervals = nintervals < meter_history_len ? nintervals : meter_history_len;
+    for(k=0; k<nintervals; k++) {
+        hidx = (meter_history_next - 1 - k + METER_SHORT_TERM_INTERVALS) % METER_SHORT_TERM_INTERVALS;
+        nframes += meter_history[hidx].nframes;
+        for(c=(cidx < 0 ? 0 : cidx); c<(cidx < 0 ? meter_nchans : cidx + 1); c++) {
+            ksum += meter_history[hidx].ksumsqs[c];
+        }
+    }
+    return nframes > 0 ? ksum / nframes : 0.0;
+}
+
+void meter_add_interval(const meter_interval_t *iv) {
+    int cidx, bin;
+    double energy, lufs;
+
+    for(cidx=0; cidx<meter_nchans; cidx++) {
+        meter_period.peaks[cidx] = iv->peaks[cidx] > meter_period.peaks[cidx] ?
+                                   iv->peaks[cidx] : meter_period.peaks[cidx];
+        meter_period.sumsqs[cidx] += iv->sumsqs[cidx];
+    }
+    meter_period.nframes += iv->nframes;
+    meter_total_nframes += iv->nframes;
+
+    meter_history[meter_history_next] = *iv;
+    meter_history_next = (meter_history_next + 1) % METER_SHORT_TERM_INTERVALS;
+    if(meter_history_len < METER_SHORT_TERM_INTERVALS) {
+        meter_history_len++;
+    }
+
+    // each new interval completes a 400 ms gating block (75% overlap)
+    if(meter_history_len >= METER_MOMENTARY_INTERVALS) {
+        energy = meter_history_energy(METER_MOMENTARY_INTERVALS, -1);
+        lufs = energy_to_lufs(energy);
+        if(lufs > METER_HIST_MIN_LUFS) {
+            bin = (int)((lufs - METER_HIST_MIN_LUFS) * 10.0);
+            bin = bin < METER_HIST_BINS ? bin : METER_HIST_BINS - 1;
+            meter_hist_energy[bin] += energy;
+            meter_hist_count[bin] += 1;
+        }
+    }
+}
+
+/* gated loudness since the start, EBU R128 / ITU-R BS.1770 */
+double meter_integrated_lufs(void) {
+    double esum = 0.0, gate;
+    uint64_t count = 0;
+    int bin, gate_bin;
+
+    // blocks in the histogram already passed the absolute gate
+    for(bin=0; bin<METER_HIST_BINS; bin++) {
+        esum += meter_hist_energy[bin];
+        count += meter_hist_count[bin];
+    }
+    if(count == 0) {
+        return -INFINITY;
+    }
+
+    // relative gate, 10 LU below the loudness of those blocks
+    gate = energy_to_lufs(esum / count) - 10.0;
+    gate_bin = (int)ceil((gate - METER_HIST_MIN_LUFS) * 10.0);
+    gate_bin = gate_bin < 0 ? 0 : gate_bin;
+    esum = 0.0;
+    count = 0;
+    for(bin=gate_bin; bin<METER_HIST_BINS; bin++) {
+        esum += meter_hist_energy[bin];
+        count += meter_hist_count[bin];
+    }
+    return count > 0 ? energy_to_lufs(esum / count) : -INFINITY;
+}
+
+/* append "key":level to the line at *pos, null for -inf */
+void json_level(char *line, int *pos, const char *key, double level, const char *sep) {
+    if(isinf(level)) {
+        *(pos) += snprintf(line + *pos, METER_JSON_SIZE - *pos, "\"%s\":null%s", key, sep);
+    }
+    else {
+        *(pos) += snprintf(line + *pos, METER_JSON_SIZE - *pos, "\"%s\":%.2f%s", key, level, sep);
+    }
+}
+
+/* print and/or publish everything metered since the last report */
+void meter_report(void) {
+    float peak_dbfs[JACK_GAIN_MAX_PORTS], rms_dbfs[JACK_GAIN_MAX_PORTS];
+    float momentary_chans[JACK_GAIN_MAX_PORTS];
+    float momentary, short_term, integrated;
+    double secs = (double)meter_total_nframes / (double)meter_samplerate;
+    int cidx;
+
+    if(meter_period.nframes == 0) {
+        return; // nothing new from the jack thread yet
+    }
+
+    for(cidx=0; cidx<meter_nchans; cidx++) {
+        peak_dbfs[cidx] = meter_period.peaks[cidx] > 0.0f ?
+                          20.0f * log10f(meter_period.peaks[cidx]) : -INFINITY;
+        rms_dbfs[cidx] = sumsq_to_db(meter_period.sumsqs[cidx], meter_period.nframes);
+        momentary_chans[cidx] = energy_to_lufs(meter_history_energy(METER_MOMENTARY_INTERVALS, cidx));
+    }
+    momentary = energy_to_lufs(meter_history_energy(METER_MOMENTARY_INTERVALS, -1));
+    short_term = energy_to_lufs(meter_history_energy(METER_SHORT_TERM_INTERVALS, -1));
+    integrated = meter_integrated_lufs();
+    meter_updates++;
+
+    if(meter_msecs > 0) {
+        // built whole and written at once, so nothing else on stdout splits it
+        char line[METER_JSON_SIZE];
+        int pos = 0;
+
+        pos += snprintf(line + pos, METER_JSON_SIZE - pos, "{\"time\":%.3f,", secs);
+        json_level(line, &pos, "momentary", momentary, ",");
+        json_level(line, &pos, "short_term", short_term, ",");
+        json_level(line, &pos, "integrated", integrated, ",");
+        pos += snprintf(line + pos, METER_JSON_SIZE - pos, "\"dropped\":%u,\"channels\":[",
+            atomic_load_explicit(&meter_dropped, memory_order_relaxed));
+        for(cidx=0; cidx<meter_nchans; cidx++) {
+            line[pos++] = '{';
+            json_level(line, &pos, "peak", peak_dbfs[cidx], ",");
+            json_level(line, &pos, "rms", rms_dbfs[cidx], ",");
+            json_level(line, &pos, "momentary", momentary_chans[cidx], cidx+1 < meter_nchans ? "}," : "}");
+        }
+        pos += snprintf(line + pos, METER_JSON_SIZE - pos, "]}\n");
+        fwrite(line, 1, pos, stdout);
+        fflush(stdout);
+    }
+
+    if(meter_shm) {
+        // seqlock, odd while writing, see jack_gain_meter.h
+        __atomic_store_n(&(meter_shm->seq), meter_shm->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        meter_shm->updates = meter_updates;
+        meter_shm->time_secs = secs;
+        meter_shm->momentary_lufs = momentary;
+        meter_shm->short_term_lufs = short_term;
+        meter_shm->integrated_lufs = integrated;
+        memcpy(meter_shm->peak_dbfs, peak_dbfs, sizeof(float) * meter_nchans);
+        memcpy(meter_shm->rms_dbfs, rms_dbfs, sizeof(float) * meter_nchans);
+        memcpy(meter_shm->momentary_lufs_chans, momentary_chans, sizeof(float) * meter_nchans);
+        __atomic_store_n(&(meter_shm->seq), meter_shm->seq + 1, __ATOMIC_RELEASE);
+    }
+
+    memset(&meter_period, 0, sizeof(meter_period));
+}
+
+void *meter_function(void *ptr) {
+    meter_interval_t iv;
+    int period_msecs = meter_msecs > 0 ? meter_msecs : METER_INTERVAL_MSECS;
+    struct timespec now, last_report;
+    long since_report = 0, nap_msecs;
+
+    ptr = ptr; // mollify compiler
+    clock_gettime(CLOCK_MONOTONIC, &last_report);
+
+    while(1) {
+        if(atomic_load_explicit(&freewheeling, memory_order_acquire)) {
+            // intervals come faster than realtime, keep up with them
+            jc_handoff_wait(&meter_wake, 1000);
+        }
+        else {
+            // drain at least every interval, since meter_ringbuf only holds
+            // METER_RING_INTERVALS of them however long -j's period is
+            nap_msecs = period_msecs - since_report;
+            nap_msecs = nap_msecs < 0 ? 0 : nap_msecs;
+            nap_msecs = nap_msecs > METER_INTERVAL_MSECS ? METER_INTERVAL_MSECS : nap_msecs;
+            usleep(nap_msecs * 1000);
+        }
+        while(PaUtil_ReadRingBuffer(&meter_ringbuf, &iv, 1) == 1) {
+            meter_add_interval(&iv);
+        }
+        jc_handoff_post(&meter_consumed);
+
+        // and report on the wall clock's period
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        since_report = (now.tv_sec - last_report.tv_sec) * 1000 + (now.tv_nsec - last_report.tv_nsec) / 1000000;
+        if(since_report >= period_msecs) {
+            meter_report();
+            last_report = now;
+            since_report = 0;
+        }
+    }
+}
+
+/* create the -S shared memory segment; it stays in /dev/shm after exit */
+int meter_open_shm(void) {
+    char name[METER_SHM_NAME_SIZE + 1];
+    int fd;
+
+    snprintf(name, sizeof(name), "%s%s", meter_shm_name[0] == '/' ? "" : "/", meter_shm_name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if(fd < 0 || ftruncate(fd, sizeof(jack_gain_meter_shm_t))) {
+        printf("Error, could not create shared memory %s: %s\n", name, strerror(errno));
+        return JACK_GAIN_SHM_ERROR;
+    }
+    meter_shm = mmap(NULL, sizeof(jack_gain_meter_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(meter_shm == MAP_FAILED) {
+        meter_shm = NULL;
+        printf("Error, could not map shared memory %s: %s\n", name, strerror(errno));
+        return JACK_GAIN_SHM_ERROR;
+    }
+
+    memset(meter_shm, 0, sizeof(jack_gain_meter_shm_t));
+    meter_shm->magic = JACK_GAIN_METER_MAGIC;
+    meter_shm->version = JACK_GAIN_METER_VERSION;
+    meter_shm->nchans = meter_nchans;
+    meter_shm->samplerate = meter_samplerate;
+    meter_shm->period_msecs = meter_msecs > 0 ? meter_msecs : METER_INTERVAL_MSECS;
+    return JACK_GAIN_NOERROR;
 }
 
 int main (int argc, char *argv[])
 {
-    const char *server_name = NULL;
-    jack_options_t options = JackNullOption;
-    jack_status_t status;
     jack_default_audio_sample_t db_gain, linear_gain;
 
     int cidx, c, ret;
+    sigset_t hupmask, waitmask;
+    pthread_t meter_thread;
 
-    char portname[JACK_PORT_NAME_SIZE] = {0};
+    /* unity gain, and -t's ramps, unless told otherwise */
+    for(cidx=0; cidx<JACK_GAIN_MAX_PORTS; cidx++) {
+        db_gains[cidx] = 0.0f;
+        linear_gains[cidx] = 1.0f;
+        ramp_msecs_chans[cidx] = -1.0f;
+    }
 
-    while ((c = getopt (argc, argv, "c:d:D:l:L:n:h")) != -1)
+    while ((c = getopt (argc, argv, "a:c:d:D:j:l:L:m:M:n:S:t:xh")) != -1)
     switch (c) {
+        case 'a':
+            delay_msecs = (float)atof(optarg);
+            delay_msecs = delay_msecs < 0.0f ? 0.0f : delay_msecs;
+            delay_msecs = delay_msecs > JACK_GAIN_MAX_DELAY_MSECS ? JACK_GAIN_MAX_DELAY_MSECS : delay_msecs;
+            break;
         case 'c':
             jackchans = atoi(optarg);
             break;
         case 'd':
-            db_gain = (jack_default_audio_sample_t)atof(optarg);
-            linear_gain = (jack_default_audio_sample_t)(pow(10.0f, db_gain / 20.0f));
-            for(cidx=0; cidx<JACK_GAIN_MAX_PORTS; cidx++) {
-                db_gains[cidx] = db_gain;
-                linear_gains[cidx] = linear_gain;
-            }
-            break;
         case 'l':
-            linear_gain = (jack_default_audio_sample_t)(atof(optarg));
-            db_gain = (jack_default_audio_sample_t)(20.0 * log10(linear_gain));
+            ret = parse_gain_value(optarg, strlen(optarg),
+                                   c == 'd' ? JACK_GAIN_DB_MODE : JACK_GAIN_LINEAR_MODE,
+                                   &db_gain, &linear_gain, NULL);
+            if(ret){
+                printf("Error, could not use gain '%s'\n", optarg);
+                usage();
+                return ret;
+            }
             for(cidx=0; cidx<JACK_GAIN_MAX_PORTS; cidx++) {
-                linear_gains[cidx] = linear_gain;
                 db_gains[cidx] = db_gain;
+                linear_gains[cidx] = linear_gain;
             }
             break;
         case 'D':
-            printf("yo, chans=%d\n", jackchans);
             ret = set_gains_from_file(optarg, JACK_GAIN_DB_MODE, &(jackchans), 
-                                      &(db_gains[0]), &(linear_gains[0]));
-            printf("yo, chans=%d\n", jackchans);
+                                      &(db_gains[0]), &(linear_gains[0]), &(ramp_msecs_chans[0]));
             if(ret){
                 printf("Error parsing %s\n", optarg);
                 usage();
                 return ret;
             }
+            snprintf(gain_fname, GAIN_FNAME_SIZE, "%s", optarg);
+            gain_fname_mode = JACK_GAIN_DB_MODE;
             break;
         case 'L':
             ret = set_gains_from_file(optarg, JACK_GAIN_LINEAR_MODE, &(jackchans), 
-                                      &(db_gains[0]), &(linear_gains[0]));
+                                      &(db_gains[0]), &(linear_gains[0]), &(ramp_msecs_chans[0]));
             if(ret){
                 printf("Error parsing %s\n", optarg);
                 usage();
                 return ret;
             }
+            snprintf(gain_fname, GAIN_FNAME_SIZE, "%s", optarg);
+            gain_fname_mode = JACK_GAIN_LINEAR_MODE;
+            break;
+        case 'm':
+        case 'M':
+            gain_fname_mode = c == 'm' ? JACK_GAIN_LINEAR_MODE : JACK_GAIN_DB_MODE;
+            ret = set_matrix_from_file(optarg, gain_fname_mode, &matrix);
+            if(ret){
+                printf("Error parsing %s\n", optarg);
+                usage();
+                return ret;
+            }
+            snprintf(gain_fname, GAIN_FNAME_SIZE, "%s", optarg);
+            matrix_mode = true;
             break;
         case 'n':
             snprintf(jackname, JACK_CLIENT_NAME_SIZE, "%s", optarg);
             break;
+        case 'j':
+            meter_msecs = atoi(optarg);
+            meter_enabled = meter_enabled || meter_msecs > 0;
+            break;
+        case 'S':
+            snprintf(meter_shm_name, METER_SHM_NAME_SIZE, "%s", optarg);
+            meter_enabled = true;
+            break;
+        case 't':
+            ramp_msecs = (float)atof(optarg);
+            ramp_msecs = ramp_msecs < 0.0f ? 0.0f : ramp_msecs;
+            break;
+        case 'x':
+            ramp_shape = JACK_GAIN_RAMP_EXPONENTIAL;
+            break;
         case 'h':
             usage();
             return 0;
@@ -238,38 +1585,77 @@ int main (int argc, char *argv[])
     }
 
     /* after parsing args, if jackchans == 0, then just print usage */
-    if(0 == jackchans) {
+    if(0 == jackchans && !matrix_mode) {
         usage();
         return JACK_GAIN_USAGE_ERROR;
     }
+    if(jackchans < 0 || jackchans > JACK_GAIN_MAX_PORTS) {
+        printf("Error, -c must be between 1 and %d\n", JACK_GAIN_MAX_PORTS);
+        return JACK_GAIN_RANGE_ERROR;
+    }
 
     /* ensure there's a reasonable jack client name if not already set */
     if( jackname[0] == 0 ) {
         snprintf(jackname, JACK_CLIENT_NAME_SIZE, "%s", "jack_gain");
     }
 
+    /* block SIGHUP before jack starts its threads, so only the
+        sigsuspend() in main's loop below ever sees it */
+    signal(SIGHUP, sighup_handler);
+    sigemptyset(&hupmask);
+    sigaddset(&hupmask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hupmask, &waitmask);
+    sigdelset(&waitmask, SIGHUP);
+
     /* open a client connection to the JACK server */
-    client = jack_client_open(jackname, options, &status, server_name);
+    client = jc_client_open(jackname, JACK_CLIENT_NAME_SIZE);
     if (client == NULL) {
-        fprintf (stderr, "jack_client_open() failed, "
-            "status = 0x%2.0x\n", status);
-        if (status & JackServerFailed) {
-            fprintf (stderr, "Unable to connect to JACK server\n");
-        }
         exit (1);
     }
 
-    if (status & JackServerStarted) {
-        fprintf (stderr, "JACK server started\n");
-    }
+    info_fp = meter_enabled ? stderr : stdout;
+    fyi();
 
-    if (status & JackNameNotUnique) {
-        snprintf(jackname, JACK_CLIENT_NAME_SIZE, "%s", jack_get_client_name(client));
-        fprintf(stderr, "unique name `%s' assigned\n", &(jackname[0]));
-    }
+    /* the jack thread starts out at the parsed gains, with no ramp */
+    samplerate = jack_get_sample_rate(client);
+    ramp_nframes = (jack_nframes_t)(ramp_msecs * 0.001f * (float)samplerate);
+    memcpy(cur_gains, linear_gains, sizeof(linear_gains));
+    memcpy(target_gains, linear_gains, sizeof(linear_gains));
+    fill_gain_bank(&(gain_banks[0]));
+    rt_matrix = matrix;
 
-    fyi();
+    /* the delay lines start out full of silence */
+    if(delay_msecs > 0.0f) {
+        delay_nframes = (jack_nframes_t)(delay_msecs * 0.001f * (float)samplerate);
+        for(cidx=0; cidx<(matrix_mode ? matrix.nout : jackchans); cidx++) {
+            if(jc_delay_init(&(delays[cidx]), delay_nframes, JACK_GAIN_MAX_FRAMES)) {
+                printf("Error, could not allocate a %u frame delay line\n", delay_nframes);
+                jack_client_close(client);
+                return JACK_GAIN_UNKNOWN_ERROR;
+            }
+        }
+        fprintf(info_fp, "INFO: outputs delayed by %u frames (%.1f ms)\n", delay_nframes, delay_msecs);
+    }
 
+    /* set up metering, before activation so the jack thread sees it all */
+    if(meter_enabled) {
+        meter_nchans = matrix_mode ? matrix.nout : jackchans;
+        meter_samplerate = jack_get_sample_rate(client);
+        meter_interval_nframes = meter_samplerate * METER_INTERVAL_MSECS / 1000;
+        meter_setup_kweighting((double)meter_samplerate);
+        PaUtil_InitializeRingBuffer(&meter_ringbuf, sizeof(meter_interval_t),
+                                    METER_RING_INTERVALS, meter_ring_memory);
+        if(jc_handoff_init(&meter_wake) || jc_handoff_init(&meter_consumed)) {
+            printf("Error, could not set up the meter handoffs (%s)\n", strerror(errno));
+            jack_client_close(client);
+            exit(1);
+        }
+        if(meter_shm_name[0] != 0 && meter_open_shm()) {
+            jack_client_close(client);
+            return JACK_GAIN_SHM_ERROR;
+        }
+        pthread_create(&meter_thread, NULL, meter_function, NULL);
+    }
     
     /* tell the JACK server to call `process()' whenever
         there is work to be done.
@@ -282,20 +1668,20 @@ int main (int argc, char *argv[])
     */
 
     jack_on_shutdown (client, jack_shutdown, 0);
+    if(delay_nframes > 0) {
+        jack_set_latency_callback(client, jack_latency, 0);
+    }
+    /* the meter is all that can fall behind a freewheeling graph */
+    if(meter_enabled) {
+        jack_set_freewheel_callback(client, jack_freewheel, 0);
+    }
 
     /* FIXME, throw error if file sample rate and jack sample rate are different */
 
     /* create jack ports */
-    for(cidx=0; cidx<jackchans; cidx++) {
-        snprintf(portname, JACK_PORT_NAME_SIZE, "in_%02d", cidx+1);
-        jackin_ports[cidx] = jack_port_register (client, portname,
-                JACK_DEFAULT_AUDIO_TYPE,
-                JackPortIsInput, 0);
-
-        snprintf(portname, JACK_PORT_NAME_SIZE, "out_%02d", cidx+1);
-        jackout_ports[cidx] = jack_port_register(client, portname,                    
-                JACK_DEFAULT_AUDIO_TYPE,
-                JackPortIsOutput, 0);
+    if(jc_register_ports(client, jackin_ports, matrix_mode ? matrix.nin : jackchans, "in", JackPortIsInput) ||
+       jc_register_ports(client, jackout_ports, matrix_mode ? matrix.nout : jackchans, "out", JackPortIsOutput)) {
+        exit (1);
     }
 
     /* Tell the JACK server that we are ready to roll.  Our
@@ -306,7 +1692,14 @@ int main (int argc, char *argv[])
         exit (1);
     }
 
-    sleep (-1);
+    /* keep running until stopped by the user */
+    while(1) {
+        sigsuspend(&waitmask);
+        if(reload_requested) {
+            reload_requested = 0;
+            reload_gains();
+        }
+    }
 
     /* this is never reached but if the program
         had some other way to exit besides being killed,
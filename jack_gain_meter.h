@@ -0,0 +1,55 @@
+/** @file jack_gain_meter.h
+ *
+ * @brief Layout of the shared memory segment that jack_gain publishes
+ * its meters in when started with -S name.
+ *
+ * Monitoring tools shm_open() the same name read-only, mmap()
+ * sizeof(jack_gain_meter_shm_t) bytes, check magic and version, and then
+ * read levels without any further syscalls.  The writer bumps seq to an
+ * odd value before an update and to the next even value after it, so a
+ * reader retries until it sees the same even seq on both sides of its copy:
+ *
+ *     do {
+ *         seq1 = __atomic_load_n(&(m->seq), __ATOMIC_ACQUIRE);
+ *         memcpy(&copy, m, sizeof(copy));
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *         seq2 = __atomic_load_n(&(m->seq), __ATOMIC_RELAXED);
+ *     } while(seq1 != seq2 || (seq1 & 1));
+ *
+ * Levels are in dBFS (peak, rms) or LUFS (loudness), and -INFINITY when
+ * there has been nothing but silence.  Loudness follows EBU R128 with
+ * every channel weighted 1.0.
+ */
+
+#ifndef JACK_GAIN_METER_H
+#define JACK_GAIN_METER_H
+
+#include <stdint.h>
+
+#define JACK_GAIN_METER_MAGIC (0x4d47414a) // "JAGM", little endian
+#define JACK_GAIN_METER_VERSION (1)
+#define JACK_GAIN_METER_MAX_CHANS (64)
+
+typedef struct jack_gain_meter_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nchans;           // metered channels, i.e. jack_gain's outputs
+    uint32_t samplerate;
+    uint32_t seq;              // odd while an update is being written
+    uint32_t period_msecs;     // how often updates are written
+    uint64_t updates;          // number of completed updates
+    double time_secs;          // seconds of audio metered so far
+
+    // whole program, summed over channels
+    float momentary_lufs;      // last 400 ms
+    float short_term_lufs;     // last 3 s
+    float integrated_lufs;     // since start, gated
+    float reserved;
+
+    // per channel, peak and rms over the last update period
+    float peak_dbfs[JACK_GAIN_METER_MAX_CHANS];
+    float rms_dbfs[JACK_GAIN_METER_MAX_CHANS];
+    float momentary_lufs_chans[JACK_GAIN_METER_MAX_CHANS];
+} jack_gain_meter_shm_t;
+
+#endif /* JACK_GAIN_METER_H */
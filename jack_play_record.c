@@ -4,6 +4,8 @@
  * audio file within JACK
  */
 
+#define _GNU_SOURCE // cpu affinity and sched_getcpu
+
 // "standard" libraries
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,12 +14,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 // libraries/code that require building/linking
 #include <pthread.h>
 #include <sndfile.h>
 #include <jack/jack.h>
 #include <pa_ringbuffer.h>
+#include "jack_play_record_tap.h"
+#include "jpr_sparse.h"
+#include "jc_client.h"
+#include "jc_hist.h"
+#include "jc_interleave.h"
+#include "jc_log.h"
+#include "jc_ring.h"
 
 #define JACK_PLAY_RECORD_MAX_PORTS (64)
 #define JACK_PLAY_RECORD_MAX_FRAMES (16384)
@@ -38,30 +58,1110 @@ SNDFILE *sndf;
 SF_INFO sndfinfo;
 int sndmode = PLAY_MODE;
 int sndchans = 0;
+int nports = 0;     // ports registered: sndchans, or with -o, how many it lists
+#define CHANNEL_MAP_SIZE (256)
+char channel_map_spec[CHANNEL_MAP_SIZE] = {0}; // -o
+int channel_map[JACK_PLAY_RECORD_MAX_PORTS];    // file channel (from 0) for each out port
 int waitchans = 0;
 int keep_waiting = 0;
+atomic_int connected_ports = 0; // our ports with at least one connection
+atomic_uint_fast64_t connected_mask = 0; // bit cidx set when port cidx has a connection
+jack_default_audio_sample_t zeros[JACK_PLAY_RECORD_MAX_FRAMES]; // recorded for unconnected inputs
 int repetitions = 0;
 int repetitions_finished = 0;
 
 char jackname[JACK_CLIENT_NAME_SIZE] = {0};
 
+// --start-at and --duration, sample accurate start and stop in jack_process
+enum start_at_mode{
+    START_NOW,
+    START_FRAME_TIME, // at an absolute jack frame time
+    START_RELATIVE,   // +N, N frames after we're first free to run
+    START_TRANSPORT };// @N, when the rolling transport reaches frame N
+#define TIME_SPEC_SIZE (64)
+char start_at_spec[TIME_SPEC_SIZE] = {0};
+char duration_spec[TIME_SPEC_SIZE] = {0};
+int start_mode = START_NOW;
+int64_t start_value = 0;          // frames, meaning depends on start_mode
+uint64_t duration_nframes = 0;    // 0 to run until stopped
+// owned by the jack thread, main only reads them once run_started is set
+jack_nframes_t run_start_frame = 0;
+uint64_t run_nframes_done = 0;
+atomic_bool run_started = false;
+struct timespec launch_time;        // when main started
+struct timespec first_cycle_time;   // when jack_process first played or recorded, set before run_started
+jack_nframes_t first_cycle_offset = 0; // and how far in to that cycle
+double fast_start_msecs = 0.0;      // --fast-start, preload only this much before activating
+atomic_bool run_finished = false; // --duration is up, time to clean up and exit
+atomic_bool fileio_stop = false;  // tells fileio_thread to drain and return
+atomic_bool server_shutdown = false; // jack_shutdown was called
+double drain_timeout_secs = 10.0; // --drain-timeout, how long to wait for the ring to drain
+
+// --sync-interval, every so often make the recording durable and note how
+// far in the journal, so a crash leaves a file that's valid up to there
+double sync_interval_secs = 0.0;  // 0 for no periodic syncing
+#define JOURNAL_FNAME_SIZE (SND_FNAME_SIZE + 16)
+char journalfname[JOURNAL_FNAME_SIZE] = {0};
+int sndfd = -1;                   // descriptor sndf was opened on, for the syncs
+int journalfd = -1;
+off_t data_offset = 0;            // where the sample data starts in sndfd
+atomic_uint_fast64_t written_nframes = 0; // handed to sndfd by fileio_thread
+atomic_uint_fast64_t header_nframes = 0;  // the file's header says this many
+atomic_bool sync_stop = false;
+sem_t sync_sem;                   // fileio_thread posts, sync_thread waits
+
+// --readahead, when playing, a thread decodes this many blocks ahead of
+// fileio_thread, with the kernel asked to fetch the file ahead of that,
+// so a slow read no longer holds up feeding the ring
+#define READAHEAD_MAX_BLOCKS (64)
+#define READAHEAD_BLOCK_FRAMES (4096)
+typedef struct readahead_block {
+    jack_default_audio_sample_t *frames; // READAHEAD_BLOCK_FRAMES of sndchans
+    int nframes;
+} readahead_block_t;
+int readahead_nblocks = 0;         // 0 reads in fileio_thread, as before
+readahead_block_t readahead_blocks[READAHEAD_MAX_BLOCKS];
+atomic_uint readahead_head = 0;    // next block to use, advanced by fileio_thread
+atomic_uint readahead_tail = 0;    // next block to fill, advanced by readahead_thread
+int readahead_offset = 0;          // frames of the head block already in the ring
+atomic_bool readahead_done = false;// every repetition has been read
+bool readahead_hints = false;      // sndfd is a seekable file, so WILLNEED hints mean something
+#define READAHEAD_COMPRESSED_BLOCKS (16) // --readahead for compressed files, unless given
+
+// A decoded copy of a compressed file, filled on the first pass so that
+// -e repetitions after it are copies instead of decodes.  Only ever
+// touched by main's preload and then readahead_thread.
+double decode_cache_mbytes = 256.0; // --decode-cache, the most to keep, 0 for none
+jack_default_audio_sample_t *decode_cache = NULL;
+sf_count_t decode_cache_capacity = 0; // frames
+sf_count_t decode_cache_nframes = 0;  // frames decoded in to it so far
+sf_count_t decode_cache_pos = 0;      // the next frame to play once it's complete
+bool decode_cache_complete = false;
+bool decode_bench = false;            // --decode-bench
+
+// --tap, a copy of what's being recorded in a shared memory ring, for
+// local tools to read in place; see jack_play_record_tap.h
+#define TAP_NAME_SIZE (256)
+char tap_name[TAP_NAME_SIZE] = {0};
+double tap_secs = 1.0;             // --tap-seconds
+jack_play_record_tap_shm_t *tap = NULL;
+jack_default_audio_sample_t *tap_frames;
+size_t tap_size = 0;
+
+// -r - and -p -, streaming to stdout and from stdin instead of a file
+enum stream_format{
+    STREAM_WAV,  // a WAV header with unknown (0xffffffff) sizes, then the data
+    STREAM_RAW };// just interleaved 32 bit floats
+int stream_format = STREAM_WAV;    // --stream-format
+int stream_fd = -1;                // stdout, when recording to it
+atomic_bool stream_closed = false; // whatever was reading stdout went away
+#define STREAM_PIPE_SIZE (1 << 20) // ask for pipes this big, for big writes
+
+// Recording to a file named *.jprs writes the sparse block format of
+// jpr_sparse.h, and -p plays one; --export turns one back in to a WAV
+jpr_sparse_t *sparse_out = NULL;
+jpr_sparse_t *sparse_in = NULL;
+double sparse_threshold_db = -INFINITY; // --sparse-threshold, drop blocks with peaks at or below this
+char export_fname[SND_FNAME_SIZE] = {0}; // --export
+
+// --timecode, a BWF bext time reference in the WAV and a sidecar of when
+// frames were recorded by jack's and the wall clock, for aligning hosts
+#define TIMECODE_DEFAULT_SECS (10.0)
+double timecode_secs = 0.0;        // between drift markers, 0 for no timecode
+#define TIMING_FNAME_SIZE (SND_FNAME_SIZE + 16)
+char timingfname[TIMING_FNAME_SIZE] = {0};
+FILE *timing_fp = NULL;            // FILE.timing, JSON lines
+bool has_bext = false;             // the file format takes a bext chunk
+bool timecode_started = false;     // the start marker is written
+// jack_process notes each point where the ring's frames stop following on
+// from each other in jack time (an overflow, an xrun) as an anchor: ring
+// frame ring_frame was jack frame jack_frame.  fileio_thread times its
+// markers from the latest anchor, rather than from the frame count alone.
+#define TIMING_ANCHORS (1024) // must be a power of 2
+typedef struct timing_anchor {
+    uint64_t ring_frame;
+    jack_nframes_t jack_frame;
+} timing_anchor_t;
+PaUtilRingBuffer timing_anchor_ring;
+timing_anchor_t timing_anchor_memory[TIMING_ANCHORS];
+atomic_uint_fast64_t timing_dropped_nframes = 0; // lost to overflow, so far
+atomic_bool timing_anchor_lost = false;          // the anchor ring was full, jack_frame may be off
+
+// --log, where the threads' messages go, by way of jc_log.h's queue;
+// stderr when empty
+char log_fname[SND_FNAME_SIZE] = {0};
+
+// -d, daemon mode: many play/record sessions in one process, sharing one
+// jack client, a pool of file i/o threads, and one slab of buffer memory
+#define DAEMON_MAX_SESSIONS (256)
+#define DAEMON_MAX_THREADS (64)
+#define SESSION_NAME_SIZE (64)
+typedef struct jpr_session {
+    char name[SESSION_NAME_SIZE];      // port name prefix
+    char fname[SND_FNAME_SIZE];
+    int mode;                          // PLAY_MODE or REC_MODE
+    int chans;
+    int repetitions, repetitions_finished;
+    SNDFILE *sndf;
+    SF_INFO info;
+    jack_port_t *ports[JACK_PLAY_RECORD_MAX_PORTS];
+    PaUtilRingBuffer ring;
+    int ring_capacity;
+    atomic_flag busy;                  // held by the i/o thread servicing it
+    atomic_bool eof;                   // played out all its repetitions, set after their last frames
+    atomic_bool done;                  // and the ring has run dry, its ports are silent
+} jpr_session_t;
+char daemon_fname[SND_FNAME_SIZE] = {0};
+jpr_session_t daemon_sessions[DAEMON_MAX_SESSIONS];
+int daemon_nsessions = 0;
+int daemon_nthreads = 2;               // -T
+char *daemon_pool;                     // the slab every session's buffers come from
+size_t daemon_pool_size = 0, daemon_pool_used = 0;
+
+// -C, connect our ports in order to the ports matching this after activation
+#define CONNECT_PATTERN_SIZE (2048)
+char connect_pattern[CONNECT_PATTERN_SIZE] = {0};
+
 // Interleaved buffers for dumping in/out of the the PaUtilRingBuffer
-// There is one for each thread, the fileio thread, and the jack thread
-jack_default_audio_sample_t linbufFILE[JACK_PLAY_RECORD_MAX_PORTS * JACK_PLAY_RECORD_MAX_FRAMES];
-jack_default_audio_sample_t linbufJACK[JACK_PLAY_RECORD_MAX_PORTS * JACK_PLAY_RECORD_MAX_FRAMES];
+// There is one for each thread, the fileio thread, and the jack thread,
+// each JACK_PLAY_RECORD_MAX_FRAMES frames of sndchans channels
+jack_default_audio_sample_t *linbufFILE;
+jack_default_audio_sample_t *linbufJACK;
 PaUtilRingBuffer pa_ringbuf_; // ringbuffer for communicating between threads
 PaUtilRingBuffer *pa_ringbuf = &(pa_ringbuf_);
 void * ringbuf_memory; // ringbuffer pointer for use with malloc/free
 int ringbuf_nframes = JACK_PLAY_RECORD_MAX_FRAMES;
+int ring_capacity = 0;        // frames the ring holds, a power of 2
+double buffer_msecs = 0.0;    // -b, size the ring for this much audio instead of -f
+
+// Disk telemetry, kept by fileio_thread and reported by main once it's joined.
+// Bucket b counts sf_readf/sf_writef calls that took [2^(b-1), 2^b) usecs.
+#define DISK_LATENCY_BUCKETS (32)
+uint64_t disk_latency_hist[DISK_LATENCY_BUCKETS];
+uint64_t disk_latency_max_usecs = 0;
+double min_ring_headroom = 1.0; // least fraction of the ring ready for jack
+#define FILEIO_MAX_POLL_USECS (85000) // 85k ~ 16k (buf) / 192k (max rate) * 1e6 (usecs)
+#define FILEIO_MIN_POLL_USECS (1000)
+int fileio_poll_usecs = FILEIO_MAX_POLL_USECS;
+
+// While jack freewheels there's no deadline to miss, so jack_process waits
+// for fileio_thread instead of under/overflowing: it posts fileio_wake when
+// it wants the ring moved, and fileio_thread posts ring_moved each time
+// around.  Posts only say fileio_thread is alive (it may be waiting on
+// readahead_thread), so freewheel_wait watches the ring itself: no movement
+// for FREEWHEEL_STALL_USECS means the file side is stuck, and the cycle goes
+// on as it would in realtime.
+atomic_bool freewheeling = false;
+jc_handoff_t fileio_wake, ring_moved;
+#define FREEWHEEL_STALL_USECS (1000000)
+
+// --profile, how long each stage of jack_process and each file i/o call
+// takes, in jc_hist.h's histograms; each has one writer, and main reports
+// them on SIGUSR1 and at exit
+enum profile_stage{
+    PROFILE_CYCLE,      // all of jack_process
+    PROFILE_PORTS,      // getting and silencing the ports' buffers
+    PROFILE_INTERLEAVE, // between the ports' buffers and linbufJACK
+    PROFILE_RING,       // reading or writing pa_ringbuf
+    PROFILE_FILE_IO,    // each file read or write, in fileio_thread or readahead_thread
+    PROFILE_NSTAGES };
+const char *profile_stage_names[PROFILE_NSTAGES] = {"cycle", "ports", "interleave", "ring", "file i/o"};
+bool profiling = false;
+jc_hist_t profile_hists[PROFILE_NSTAGES];
+
+// Memory locking and fileio_thread scheduling, keeping page faults and
+// disk work away from the jack thread
+enum lock_memory_mode{
+    LOCK_MEMORY_NONE,
+    LOCK_MEMORY_BUFFERS, // -m, prefault and mlock the ring and linbufs
+    LOCK_MEMORY_ALL };   // -M, mlockall everything, now and later
+int lock_memory = LOCK_MEMORY_NONE;
+int fileio_priority = 0;   // -P, SCHED_FIFO priority, 0 leaves the default
+cpu_set_t fileio_cpus;     // -a, empty for no pinning
+int avoid_jack_cpu = 0;    // -A
+atomic_int jack_cpu = -1;  // cpu that jack_process last ran on
+
+double elapsed_msecs(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1e3 * (now.tv_sec - since->tv_sec) + 1e-6 * (now.tv_nsec - since->tv_nsec);
+}
+
+/* with --profile, time stage from *since until now, and start the next one */
+static inline void profile_lap(int stage, uint64_t *since) {
+    uint64_t now;
+
+    if(profiling) {
+        now = jc_now_ns();
+        jc_hist_record(&(profile_hists[stage]), now - *since);
+        *since = now;
+    }
+}
+
+/* what share of the period jack_process and its stages take, and how long
+ * file i/o calls take; the counts may be a cycle apart from each other */
+void profile_report(void) {
+    jack_nframes_t period = jack_get_buffer_size(client), rate = jack_get_sample_rate(client);
+    double budget_usecs = 1e6 * period / rate;
+    jc_hist_t *hist;
+    uint64_t total;
+    double p99;
+    int stage;
+
+    printf("INFO: profile, in usecs, of a %u frame (%.0f usecs) period\n", period, budget_usecs);
+    printf("    %-10s %10s %8s %8s %8s %8s %8s %7s\n",
+        "stage", "count", "mean", "p50", "p99", "p99.9", "max", "p99 %");
+    for(stage=0; stage<PROFILE_NSTAGES; stage++) {
+        hist = &(profile_hists[stage]);
+        if((total = jc_hist_count(hist)) == 0) {
+            continue;
+        }
+        p99 = jc_hist_percentile(hist, total, 99.0) / 1e3;
+        printf("    %-10s %10" PRIu64 " %8.1f %8.1f %8.1f %8.1f %8.1f %6.1f%%\n",
+            profile_stage_names[stage], total,
+            atomic_load_explicit(&(hist->total_ns), memory_order_relaxed) / 1e3 / total,
+            jc_hist_percentile(hist, total, 50.0) / 1e3, p99, jc_hist_percentile(hist, total, 99.9) / 1e3,
+            atomic_load_explicit(&(hist->max_ns), memory_order_relaxed) / 1e3,
+            100.0 * p99 / budget_usecs);
+    }
+}
+
+/* note how long a file read or write took, from start until now */
+void record_disk_latency(const struct timespec *start) {
+    double msecs = elapsed_msecs(start);
+    uint64_t usecs = (uint64_t)(msecs * 1e3);
+    int bucket = 0;
+
+    if(profiling) {
+        jc_hist_record(&(profile_hists[PROFILE_FILE_IO]), (uint64_t)(msecs * 1e6));
+    }
+
+    while(bucket < DISK_LATENCY_BUCKETS-1 && (1ull << bucket) <= usecs) {
+        bucket++;
+    }
+    disk_latency_hist[bucket]++;
+    if(usecs > disk_latency_max_usecs) {
+        disk_latency_max_usecs = usecs;
+    }
+}
+
+/* the upper bound, in msecs, of the latency bucket holding percentile pct */
+double disk_latency_percentile(double pct) {
+    uint64_t total = 0, seen = 0;
+    int bucket;
+
+    for(bucket=0; bucket<DISK_LATENCY_BUCKETS; bucket++) {
+        total += disk_latency_hist[bucket];
+    }
+    for(bucket=0; bucket<DISK_LATENCY_BUCKETS && total > 0; bucket++) {
+        seen += disk_latency_hist[bucket];
+        if(seen >= pct / 100.0 * total) {
+            break;
+        }
+    }
+    return (double)(1ull << bucket) / 1e3;
+}
+
+/* read from whichever kind of file is playing */
+sf_count_t file_readf(jack_default_audio_sample_t *frames, sf_count_t nframes) {
+    if(sparse_in != NULL) {
+        return jpr_sparse_readf(sparse_in, frames, (int)nframes);
+    }
+    return sf_readf_float(sndf, frames, nframes);
+}
+
+void file_rewind(void) {
+    if(sparse_in != NULL) {
+        jpr_sparse_rewind(sparse_in);
+    }
+    else {
+        sf_seek(sndf, 0, SEEK_SET);
+    }
+}
+
+/* write to whichever kind of file is recording */
+sf_count_t file_writef(const jack_default_audio_sample_t *frames, sf_count_t nframes) {
+    if(sparse_out != NULL) {
+        return jpr_sparse_writef(sparse_out, frames, (int)nframes);
+    }
+    return sf_writef_float(sndf, frames, nframes);
+}
+
+/* whether fname should be recorded in the sparse format */
+bool is_sparse_name(const char *fname) {
+    size_t len = strlen(fname);
+    return len > 5 && 0 == strcmp(fname + len - 5, ".jprs");
+}
+
+/* time one chunk's read from the file, as a first guess at how far ahead
+ * of the jack thread the ring needs to be, then rewind */
+double probe_read_latency(void) {
+    struct timespec start;
+    double msecs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    file_readf(linbufFILE, JACK_PLAY_RECORD_MAX_FRAMES);
+    msecs = elapsed_msecs(&start);
+    file_rewind();
+    return msecs;
+}
+
+/* Work out the ring's capacity.  With -b, enough for buffer_msecs of audio
+ * plus the longest fileio_thread may sleep plus latency_msecs of disk stall,
+ * and never less than two jack periods; otherwise the old 4 * -f frames. */
+int ring_frames_for(jack_nframes_t rate, jack_nframes_t period, double latency_msecs) {
+    double msecs;
+    int nframes;
+
+    if(buffer_msecs <= 0.0) {
+        return 4 * jc_nextpow2(ringbuf_nframes);
+    }
+    msecs = buffer_msecs + latency_msecs + FILEIO_MAX_POLL_USECS / 1e3;
+    nframes = (int)(rate * msecs / 1e3) + 1;
+    if(nframes < 2 * (int)period) {
+        nframes = 2 * period;
+    }
+    return jc_nextpow2(nframes);
+}
+
+/* parse a cpu list like "0,2-3" in to set, returns 0 on success */
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while(*list) {
+        first = strtol(list, &end, 10);
+        if(end == list || first < 0 || first >= CPU_SETSIZE) {
+            return 1;
+        }
+        last = first;
+        if(*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if(end == list || last < first || last >= CPU_SETSIZE) {
+                return 1;
+            }
+        }
+        for(; first<=last; first++) {
+            CPU_SET(first, set);
+        }
+        if(*end == ',') {
+            end++;
+        }
+        else if(*end != 0) {
+            return 1;
+        }
+        list = end;
+    }
+    return CPU_COUNT(set) == 0;
+}
+
+/* Parse -o, a list of 1-based file channels for the output ports in order,
+ * like "3,1,1" or "9-12,1", in to channel_map, checking them against the
+ * file's chans.  Returns the number of ports, or 0 when it doesn't parse. */
+int parse_channel_map(const char *list, int chans) {
+    char *end;
+    long first, last, step;
+    int nmapped = 0;
+
+    while(*list) {
+        first = strtol(list, &end, 10);
+        if(end == list || first < 1 || first > chans) {
+            return 0;
+        }
+        last = first;
+        if(*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if(end == list || last < 1 || last > chans) {
+                return 0;
+            }
+        }
+        step = last >= first ? 1 : -1;
+        for(; ; first+=step) {
+            if(nmapped == JACK_PLAY_RECORD_MAX_PORTS) {
+                return 0;
+            }
+            channel_map[nmapped++] = (int)first - 1;
+            if(first == last) {
+                break;
+            }
+        }
+        if(*end == ',') {
+            end++;
+        }
+        else if(*end != 0) {
+            return 0;
+        }
+        list = end;
+    }
+    return nmapped;
+}
+
+/* pin fileio_thread to -a's cpus, and with -A off the jack thread's cpu;
+ * cheap to call often since it only acts when the jack thread moves */
+void update_fileio_affinity(void) {
+    static int applied_for = -2;
+    int cpu = avoid_jack_cpu ? atomic_load_explicit(&jack_cpu, memory_order_relaxed) : -1;
+    cpu_set_t set;
+    long ncpus, cidx;
+
+    if(cpu == applied_for) {
+        return;
+    }
+    applied_for = cpu;
+
+    if(CPU_COUNT(&fileio_cpus) > 0) {
+        set = fileio_cpus;
+    }
+    else {
+        CPU_ZERO(&set);
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for(cidx=0; cidx<ncpus && cidx<CPU_SETSIZE; cidx++) {
+            CPU_SET(cidx, &set);
+        }
+    }
+    if(cpu >= 0) {
+        CPU_CLR(cpu, &set);
+        if(CPU_COUNT(&set) == 0) {
+            return; // nowhere else to go
+        }
+    }
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        printf("WRN: could not set the cpu affinity of the file i/o thread\n");
+    }
+}
+
+/* touch every page of a buffer and, if asked to, lock it in to RAM */
+void prefault_and_lock(void *buf, size_t size, const char *what) {
+    memset(buf, 0, size);
+    if(lock_memory == LOCK_MEMORY_BUFFERS && mlock(buf, size)) {
+        printf("WRN: could not mlock %zu bytes of %s (%s), check ulimit -l\n",
+            size, what, strerror(errno));
+    }
+}
+
+/* How often fileio_thread wakes up: a quarter of the ring's worth of audio,
+ * at most 85 ms, and four times as often while the ring is running low.
+ * headroom is the fraction of the ring ready for the jack thread, filled
+ * frames when playing and free frames when recording. */
+void adapt_fileio_poll(void) {
+    int avail = sndmode == PLAY_MODE ?
+        PaUtil_GetRingBufferReadAvailable(pa_ringbuf) :
+        PaUtil_GetRingBufferWriteAvailable(pa_ringbuf);
+    double headroom = (double)avail / ring_capacity;
+    int usecs = (int)(250000.0 * ring_capacity / sndfinfo.samplerate);
+
+    if(headroom < min_ring_headroom) {
+        min_ring_headroom = headroom;
+    }
+    if(usecs > FILEIO_MAX_POLL_USECS) {
+        usecs = FILEIO_MAX_POLL_USECS;
+    }
+    if(headroom < 0.25) {
+        usecs /= 4;
+    }
+    fileio_poll_usecs = usecs < FILEIO_MIN_POLL_USECS ? FILEIO_MIN_POLL_USECS : usecs;
+}
+
+/* (re)write the journal, saying the first nframes of the recording are on
+ * disk.  The record is always the same length, so each pwrite replaces
+ * the whole of the previous one. */
+void write_journal(uint64_t nframes) {
+    char record[SND_FNAME_SIZE + 256];
+    size_t framesize = sizeof(jack_default_audio_sample_t) * sndchans;
+    int len;
+
+    len = snprintf(record, sizeof(record),
+        "jack_play_record journal 1\n"
+        "file %s\n"
+        "samplerate %d\n"
+        "channels %d\n"
+        "format wav float\n"
+        "data_offset %20" PRIu64 "\n"
+        "durable_frames %20" PRIu64 "\n"
+        "durable_bytes %20" PRIu64 "\n",
+        sndfname, sndfinfo.samplerate, sndchans, (uint64_t)data_offset,
+        nframes, (uint64_t)data_offset + nframes * framesize);
+    if(len >= (int)sizeof(record)) {
+        len = sizeof(record) - 1;
+    }
+    if(pwrite(journalfd, record, len, 0) != len || fdatasync(journalfd)) {
+        JC_LOG("WRN: could not update the journal %s (%s)\n", journalfname, strerror(errno));
+    }
+}
+
+/**
+ * With --sync-interval, this thread does everything that can block on the
+ * disk for a long time, so fileio_thread never waits on it: start writeback
+ * of whatever fileio_thread has written so far, and once the header has been
+ * brought up to date, fdatasync the file and then record in the journal how
+ * much of it is now durable.
+ */
+void *sync_function(void *ptr) {
+    size_t framesize = sizeof(jack_default_audio_sample_t) * sndchans;
+    off_t kicked = data_offset, end;
+    uint64_t nframes, durable_nframes = 0;
+    bool stopping;
+
+    ptr = ptr; // mollify compiler
+
+    while(1) {
+        while(sem_wait(&sync_sem) && errno == EINTR);
+        stopping = atomic_load_explicit(&sync_stop, memory_order_acquire);
+
+        // get the kernel writing back new data now, rather than all at the next fdatasync
+        end = data_offset + (off_t)(atomic_load_explicit(&written_nframes, memory_order_acquire) * framesize);
+        if(end > kicked) {
+            sync_file_range(sndfd, kicked, end - kicked, SYNC_FILE_RANGE_WRITE);
+            kicked = end;
+        }
+
+        nframes = atomic_load_explicit(&header_nframes, memory_order_acquire);
+        if(nframes > durable_nframes) {
+            if(fdatasync(sndfd)) {
+                JC_LOG("WRN: could not fdatasync %s (%s)\n", sndfname, strerror(errno));
+            }
+            else {
+                write_journal(nframes);
+                durable_nframes = nframes;
+            }
+        }
+
+        if(stopping) {
+            return NULL;
+        }
+    }
+}
+
+/* create the --tap shared memory segment; like jack_gain's -S it stays in
+ * /dev/shm after exit, so late readers still find the last of the audio */
+int open_tap(jack_nframes_t rate) {
+    char name[TAP_NAME_SIZE + 1];
+    size_t header_size = (sizeof(jack_play_record_tap_shm_t) + 4095) & ~((size_t)4095);
+    uint64_t capacity = jc_nextpow2((int)(tap_secs * rate));
+    int fd;
+
+    tap_size = header_size + sizeof(jack_default_audio_sample_t) * sndchans * capacity;
+    snprintf(name, sizeof(name), "%s%s", tap_name[0] == '/' ? "" : "/", tap_name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if(fd < 0 || ftruncate(fd, tap_size)) {
+        printf("Error, could not create shared memory %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    tap = mmap(NULL, tap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(tap == MAP_FAILED) {
+        tap = NULL;
+        printf("Error, could not map shared memory %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    if(lock_memory != LOCK_MEMORY_NONE) {
+        prefault_and_lock(tap, tap_size, "the tap");
+    }
+
+    memset(tap, 0, header_size);
+    tap->header_size = header_size;
+    tap->nchans = sndchans;
+    tap->samplerate = rate;
+    tap->capacity = capacity;
+    tap->data_offset = header_size;
+    tap_frames = (jack_default_audio_sample_t *)((char *)tap + header_size);
+    tap->version = JACK_PLAY_RECORD_TAP_VERSION;
+    __atomic_store_n(&(tap->magic), JACK_PLAY_RECORD_TAP_MAGIC, __ATOMIC_RELEASE);
+    printf("INFO: tapping the recording in to shared memory %s, %" PRIu64 " frames, %.1f KiB\n",
+        name, capacity, tap_size / 1024.0);
+    return 0;
+}
+
+/* fileio_thread copies what it takes out of the ring in to the tap too:
+ * claim_frame goes first so readers can tell frames are being overwritten,
+ * and write_frame after to publish them */
+void write_tap(const jack_default_audio_sample_t *frames, int nframes) {
+    uint64_t wf = tap->write_frame, capacity = tap->capacity, first, pos, n;
+
+    if(wf == 0 && atomic_load_explicit(&run_started, memory_order_acquire)) {
+        tap->start_frame_time = run_start_frame;
+    }
+    // when asked for more than the ring holds, only the newest frames matter
+    first = (uint64_t)nframes > capacity ? nframes - capacity : 0;
+    __atomic_store_n(&(tap->claim_frame), wf + nframes, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // the claim is seen before any of the copy
+
+    pos = (wf + first) & (capacity - 1);
+    n = nframes - first;
+    if(pos + n > capacity) {
+        memcpy(tap_frames + pos * sndchans, frames + first * sndchans,
+            sizeof(jack_default_audio_sample_t) * sndchans * (capacity - pos));
+        first += capacity - pos;
+        n -= capacity - pos;
+        pos = 0;
+    }
+    memcpy(tap_frames + pos * sndchans, frames + first * sndchans,
+        sizeof(jack_default_audio_sample_t) * sndchans * n);
+    __atomic_store_n(&(tap->write_frame), wf + nframes, __ATOMIC_RELEASE);
+}
+
+/* mark the tap finished, and say how far behind any registered readers were */
+void close_tap(void) {
+    int ridx;
+
+    __atomic_or_fetch(&(tap->flags), JACK_PLAY_RECORD_TAP_FINISHED, __ATOMIC_RELEASE);
+    for(ridx=0; ridx<JACK_PLAY_RECORD_TAP_MAX_READERS; ridx++) {
+        uint32_t pid = __atomic_load_n(&(tap->readers[ridx].pid), __ATOMIC_ACQUIRE);
+        if(pid != 0) {
+            printf("INFO: tap reader %u was %" PRIu64 " frames behind\n", pid,
+                tap->write_frame - __atomic_load_n(&(tap->readers[ridx].read_frame), __ATOMIC_RELAXED));
+        }
+    }
+    munmap(tap, tap_size);
+    tap = NULL;
+}
+
+/* -r -: send the header, if any, that starts the stream */
+int write_stream_header(jack_nframes_t rate) {
+    unsigned char hdr[44];
+    uint32_t fields[] = {
+        0x46464952, 0xffffffff, 0x45564157,     // "RIFF", unknown size, "WAVE"
+        0x20746d66, 16,                         // "fmt ", 16 bytes of it
+        3 | ((uint32_t)sndchans << 16),         // IEEE float, channels
+        rate,
+        rate * sndchans * 4,                    // bytes per second
+        (sndchans * 4) | (32 << 16),            // bytes per frame, bits per sample
+        0x61746164, 0xffffffff };               // "data", unknown size
+    unsigned int fidx, bidx;
+
+    if(stream_format == STREAM_RAW) {
+        return 0;
+    }
+    for(fidx=0; fidx<sizeof(fields)/sizeof(fields[0]); fidx++) {
+        for(bidx=0; bidx<4; bidx++) {
+            hdr[4*fidx + bidx] = (fields[fidx] >> (8*bidx)) & 0xff; // little endian
+        }
+    }
+    return write(stream_fd, hdr, sizeof(hdr)) != sizeof(hdr);
+}
+
+/* -r -: write everything in the ring to stream_fd straight out of the
+ * ring's memory, both regions of it with one writev, and only then give
+ * the space back to the jack thread */
+void stream_out(void) {
+    void *data1, *data2;
+    ring_buffer_size_t size1, size2;
+    size_t framesize = sizeof(jack_default_audio_sample_t) * sndchans;
+    struct iovec iov[2], *next;
+    struct timespec io_start;
+    ssize_t written;
+    int niov, nframes;
+
+    while((nframes = PaUtil_GetRingBufferReadRegions(pa_ringbuf,
+            PaUtil_GetRingBufferReadAvailable(pa_ringbuf), &data1, &size1, &data2, &size2)) > 0) {
+        if(tap != NULL) {
+            write_tap(data1, size1);
+            write_tap(data2, size2);
+        }
+        iov[0].iov_base = data1;
+        iov[0].iov_len = size1 * framesize;
+        iov[1].iov_base = data2;
+        iov[1].iov_len = size2 * framesize;
+        niov = size2 > 0 ? 2 : 1;
+        next = iov;
+
+        // a pipe takes what it has room for, carry on from there
+        clock_gettime(CLOCK_MONOTONIC, &io_start);
+        while(niov > 0 && !atomic_load_explicit(&stream_closed, memory_order_relaxed)) {
+            written = writev(stream_fd, next, niov);
+            if(written < 0) {
+                if(errno != EINTR) {
+                    JC_LOG("WRN: could not write to stdout (%s), stopping\n", strerror(errno));
+                    atomic_store_explicit(&stream_closed, true, memory_order_release);
+                }
+                continue;
+            }
+            while(niov > 0 && (size_t)written >= next->iov_len) {
+                written -= next->iov_len;
+                next++;
+                niov--;
+            }
+            if(niov > 0) {
+                next->iov_base = (char *)next->iov_base + written;
+                next->iov_len -= written;
+            }
+        }
+        record_disk_latency(&io_start);
+        PaUtil_AdvanceRingBufferReadIndex(pa_ringbuf, nframes);
+    }
+}
+
+/* whether libsndfile has to decode this file, rather than only convert samples */
+bool is_compressed(int format) {
+    switch(format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8:
+        case SF_FORMAT_PCM_16:
+        case SF_FORMAT_PCM_24:
+        case SF_FORMAT_PCM_32:
+        case SF_FORMAT_FLOAT:
+        case SF_FORMAT_DOUBLE:
+            return (format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
+        default:
+            return true;
+    }
+}
+
+/* keep a copy of nframes freshly decoded from the start of the file onwards,
+ * giving up on the cache if the file turns out longer than it said */
+void cache_decoded(const jack_default_audio_sample_t *frames, int nframes) {
+    if(decode_cache == NULL || decode_cache_complete) {
+        return;
+    }
+    if(decode_cache_nframes + nframes > decode_cache_capacity) {
+        free(decode_cache);
+        decode_cache = NULL;
+        return;
+    }
+    memcpy(decode_cache + decode_cache_nframes * sndchans, frames,
+        sizeof(jack_default_audio_sample_t) * sndchans * nframes);
+    decode_cache_nframes += nframes;
+}
+
+/* the next nframes from the complete decode_cache, as sf_readf_float would */
+int read_decode_cache(jack_default_audio_sample_t *frames, int nframes) {
+    if(nframes > decode_cache_nframes - decode_cache_pos) {
+        nframes = (int)(decode_cache_nframes - decode_cache_pos);
+    }
+    memcpy(frames, decode_cache + decode_cache_pos * sndchans,
+        sizeof(jack_default_audio_sample_t) * sndchans * nframes);
+    decode_cache_pos += nframes;
+    return nframes;
+}
+
+/* --decode-bench: decode all of sndfname as fast as possible, and report
+ * how fast that was, without jack */
+int run_decode_bench(void) {
+    SF_FORMAT_INFO major, subtype;
+    SF_INFO info = {0};
+    SNDFILE *bench;
+    jack_default_audio_sample_t *buf;
+    struct timespec start;
+    sf_count_t nframes = 0, nread;
+    double msecs;
+
+    bench = sf_open(sndfname, SFM_READ, &info);
+    if(bench == NULL) {
+        printf("Error, could not open %s (%s)\n", sndfname, sf_strerror(NULL));
+        return 1;
+    }
+    buf = malloc(sizeof(jack_default_audio_sample_t) * info.channels * READAHEAD_BLOCK_FRAMES);
+    if(buf == NULL) {
+        sf_close(bench);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while((nread = sf_readf_float(bench, buf, READAHEAD_BLOCK_FRAMES)) > 0) {
+        nframes += nread;
+    }
+    msecs = elapsed_msecs(&start);
+
+    major.format = info.format & SF_FORMAT_TYPEMASK;
+    subtype.format = info.format & SF_FORMAT_SUBMASK;
+    major.name = subtype.name = "unknown";
+    sf_command(NULL, SFC_GET_FORMAT_INFO, &major, sizeof(major));
+    sf_command(NULL, SFC_GET_FORMAT_INFO, &subtype, sizeof(subtype));
+    printf("INFO: decoded %" PRId64 " frames of %d channel %s (%s) in %.1f ms, "
+        "%.0f frames/s, %.1f x realtime\n",
+        (int64_t)nframes, info.channels, major.name, subtype.name, msecs,
+        nframes / (msecs / 1e3), nframes / (msecs / 1e3) / info.samplerate);
+
+    free(buf);
+    sf_close(bench);
+    return 0;
+}
+
+/**
+ * With --readahead, this thread owns sndf while playing.  It decodes blocks
+ * in to readahead_blocks as fast as fileio_thread frees them, and before
+ * each read of a seekable file it tells the kernel about the bytes the next
+ * few blocks will need, so those reads are already in flight while this one
+ * decodes.
+ */
+void *readahead_function(void *ptr) {
+    readahead_block_t *blk;
+    struct timespec io_start;
+    unsigned head, tail;
+    off_t pos, block_bytes = 0;
+
+    ptr = ptr; // mollify compiler
+
+    while(!atomic_load_explicit(&fileio_stop, memory_order_acquire)) {
+        head = atomic_load_explicit(&readahead_head, memory_order_acquire);
+        tail = atomic_load_explicit(&readahead_tail, memory_order_relaxed);
+        if(tail - head == (unsigned)readahead_nblocks ||
+           atomic_load_explicit(&readahead_done, memory_order_relaxed)) {
+            usleep(FILEIO_MIN_POLL_USECS);
+            continue;
+        }
+
+        pos = readahead_hints ? lseek(sndfd, 0, SEEK_CUR) : 0;
+        if(block_bytes > 0) {
+            posix_fadvise(sndfd, pos, block_bytes * readahead_nblocks, POSIX_FADV_WILLNEED);
+        }
+
+        blk = &(readahead_blocks[tail % readahead_nblocks]);
+        if(decode_cache_complete) {
+            blk->nframes = read_decode_cache(blk->frames, READAHEAD_BLOCK_FRAMES);
+        }
+        else {
+            clock_gettime(CLOCK_MONOTONIC, &io_start);
+            blk->nframes = file_readf(blk->frames, READAHEAD_BLOCK_FRAMES);
+            record_disk_latency(&io_start);
+            cache_decoded(blk->frames, blk->nframes);
+        }
+        if(readahead_hints && blk->nframes == READAHEAD_BLOCK_FRAMES && lseek(sndfd, 0, SEEK_CUR) > pos) {
+            // how many bytes of file a block takes, whatever the format
+            block_bytes = lseek(sndfd, 0, SEEK_CUR) - pos;
+        }
+        atomic_store_explicit(&readahead_tail, tail + 1, memory_order_release);
+
+        if(blk->nframes < READAHEAD_BLOCK_FRAMES) {
+            if(decode_cache != NULL && !decode_cache_complete) {
+                JC_LOG("INFO: cached %" PRId64 " decoded frames, repetitions will play from memory\n",
+                    (int64_t)decode_cache_nframes);
+                decode_cache_complete = true;
+            }
+            decode_cache_pos = 0;
+            file_rewind(); // rewind to beginning of file
+            repetitions_finished += 1;
+            if(repetitions > 0 && repetitions_finished >= repetitions) {
+                // after the last block's tail, so fileio_thread sees it first
+                atomic_store_explicit(&readahead_done, true, memory_order_release);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* allocate readahead_blocks, one slab for all of them */
+int init_readahead(void) {
+    size_t block_size = sizeof(jack_default_audio_sample_t) * sndchans * READAHEAD_BLOCK_FRAMES;
+    char *slab;
+    int bidx;
+
+    readahead_nblocks = readahead_nblocks > READAHEAD_MAX_BLOCKS ? READAHEAD_MAX_BLOCKS : readahead_nblocks;
+    slab = malloc(block_size * readahead_nblocks);
+    if(slab == NULL) {
+        return 1;
+    }
+    for(bidx=0; bidx<readahead_nblocks; bidx++) {
+        readahead_blocks[bidx].frames = (jack_default_audio_sample_t *)(slab + bidx * block_size);
+    }
+    if(lock_memory != LOCK_MEMORY_NONE) {
+        prefault_and_lock(slab, block_size * readahead_nblocks, "readahead blocks");
+    }
+    // a sparse file has no sndfd, and a pipe can't be told what comes next
+    readahead_hints = sndfd >= 0 && lseek(sndfd, 0, SEEK_CUR) >= 0;
+    return 0;
+}
+
+/* fileio_thread's half of --readahead: copy decoded blocks in to the ring
+ * in order, and silence once they've all been played */
+void feed_from_readahead(void) {
+    readahead_block_t *blk;
+    unsigned head, tail;
+    int space, nframes;
+    bool done;
+
+    // done before tail, the last block is published before done is set
+    done = atomic_load_explicit(&readahead_done, memory_order_acquire);
+    tail = atomic_load_explicit(&readahead_tail, memory_order_acquire);
+    head = atomic_load_explicit(&readahead_head, memory_order_relaxed);
+    space = PaUtil_GetRingBufferWriteAvailable(pa_ringbuf);
+
+    while(space > 0 && head != tail) {
+        blk = &(readahead_blocks[head % readahead_nblocks]);
+        nframes = blk->nframes - readahead_offset;
+        nframes = nframes > space ? space : nframes;
+        PaUtil_WriteRingBuffer(pa_ringbuf, blk->frames + readahead_offset * sndchans, nframes);
+        space -= nframes;
+        readahead_offset += nframes;
+        if(readahead_offset == blk->nframes) {
+            readahead_offset = 0;
+            head++;
+            atomic_store_explicit(&readahead_head, head, memory_order_release);
+        }
+    }
+
+    if(done && head == tail && space > 0) {
+        space = space > JACK_PLAY_RECORD_MAX_FRAMES ? JACK_PLAY_RECORD_MAX_FRAMES : space;
+        memset(linbufFILE, 0, sizeof(jack_default_audio_sample_t) * sndchans * space);
+        PaUtil_WriteRingBuffer(pa_ringbuf, linbufFILE, space);
+    }
+}
+
+/* the wall clock time, in ns since the epoch, at which jack frame time
+ * frame was (or will be) processed, by way of jack's own clock */
+int64_t frame_wall_ns(jack_nframes_t frame, jack_time_t *frame_usecs) {
+    struct timespec now;
+    jack_time_t jack_now = jack_get_time();
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    *(frame_usecs) = jack_frames_to_time(client, frame);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec -
+        ((int64_t)jack_now - (int64_t)*(frame_usecs)) * 1000;
+}
+
+/* Set the bext chunk, with the first frame's time as samples since local
+ * midnight when first_wall_ns is known.  Returns the time reference. */
+uint64_t set_bext(int64_t first_wall_ns) {
+    SF_BROADCAST_INFO bext;
+    char date[16], clock[16];
+    time_t secs;
+    struct tm tm;
+    uint64_t time_reference = 0;
+
+    memset(&bext, 0, sizeof(bext));
+    snprintf(bext.description, sizeof(bext.description), "jack_play_record, jack client %.200s", jackname);
+    snprintf(bext.originator, sizeof(bext.originator), "jack_play_record");
+    gethostname(bext.originator_reference, sizeof(bext.originator_reference) - 1);
+    bext.version = 1;
+    if(first_wall_ns > 0) {
+        secs = (time_t)(first_wall_ns / 1000000000);
+        localtime_r(&secs, &tm);
+        time_reference = (uint64_t)(((tm.tm_hour * 60 + tm.tm_min) * 60 + tm.tm_sec +
+            (first_wall_ns % 1000000000) / 1e9) * sndfinfo.samplerate + 0.5);
+        strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+        strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+        memcpy(bext.origination_date, date, sizeof(bext.origination_date));
+        memcpy(bext.origination_time, clock, sizeof(bext.origination_time));
+    }
+    bext.time_reference_low = (uint32_t)(time_reference & 0xffffffffu);
+    bext.time_reference_high = (uint32_t)(time_reference >> 32);
+    has_bext = sf_command(sndf, SFC_SET_BROADCAST_INFO, &bext, sizeof(bext)) == SF_TRUE;
+    return time_reference;
+}
+
+/* the jack thread's side of the anchors: a block of nframes_written frames
+ * recorded from jack frame jack_frame on, after nframes_lost were dropped */
+static void note_timing_anchor(jack_nframes_t jack_frame, jack_nframes_t nframes_written,
+                               jack_nframes_t nframes_lost) {
+    static uint64_t ring_frame = 0;
+    static jack_nframes_t next_jack_frame;
+    static bool anchored = false;
+    timing_anchor_t anchor;
+
+    if(nframes_lost > 0) {
+        atomic_fetch_add_explicit(&timing_dropped_nframes, nframes_lost, memory_order_relaxed);
+    }
+    if(nframes_written == 0) {
+        return;
+    }
+    if(!anchored || jack_frame != next_jack_frame) {
+        anchor.ring_frame = ring_frame;
+        anchor.jack_frame = jack_frame;
+        if(PaUtil_WriteRingBuffer(&timing_anchor_ring, &anchor, 1) != 1) {
+            atomic_store_explicit(&timing_anchor_lost, true, memory_order_relaxed);
+        }
+        anchored = true;
+    }
+    ring_frame += nframes_written;
+    next_jack_frame = jack_frame + nframes_written; // wraps like jack's
+}
+
+/* the jack frame file frame file_frame was recorded at; file_frame never
+ * goes backwards, so anchors before it are done with */
+jack_nframes_t timing_jack_frame(uint64_t file_frame) {
+    static timing_anchor_t anchor, next;
+    static bool started = false, have_next = false;
+
+    if(!started) {
+        anchor.ring_frame = 0;
+        anchor.jack_frame = run_start_frame;
+        started = true;
+    }
+    while(1) {
+        if(!have_next) {
+            if(PaUtil_ReadRingBuffer(&timing_anchor_ring, &next, 1) != 1) {
+                break;
+            }
+            have_next = true;
+        }
+        if(next.ring_frame > file_frame) {
+            break;
+        }
+        anchor = next;
+        have_next = false;
+    }
+    return anchor.jack_frame + (jack_nframes_t)(file_frame - anchor.ring_frame);
+}
+
+/* str as a JSON string, quotes included */
+void fput_json_string(const char *str, FILE *fp) {
+    const unsigned char *c;
+
+    fputc('"', fp);
+    for(c=(const unsigned char *)str; *c; c++) {
+        if(*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        }
+        else if(*c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* one line of the timing sidecar: file frame file_frame was jack frame
+ * timing_jack_frame(file_frame), and when that was by jack's and the wall
+ * clock; dropped_frames is how many never made it to the file so far */
+void write_timing_marker(const char *event, uint64_t file_frame, uint64_t time_reference) {
+    jack_nframes_t frame = timing_jack_frame(file_frame);
+    jack_time_t usecs;
+    int64_t wall_ns = frame_wall_ns(frame, &usecs);
+
+    fprintf(timing_fp, "{\"event\": \"%s\", \"file_frame\": %" PRIu64 ", \"jack_frame\": %u, "
+        "\"jack_usecs\": %" PRIu64 ", \"wall_ns\": %" PRId64 ", \"dropped_frames\": %" PRIu64,
+        event, file_frame, frame, (uint64_t)usecs, wall_ns,
+        (uint64_t)atomic_load_explicit(&timing_dropped_nframes, memory_order_relaxed));
+    if(atomic_load_explicit(&timing_anchor_lost, memory_order_relaxed)) {
+        fprintf(timing_fp, ", \"inexact\": true");
+    }
+    if(0 == strcmp(event, "start")) {
+        fprintf(timing_fp, ", \"file\": ");
+        fput_json_string(sndfname, timing_fp);
+        fprintf(timing_fp, ", \"samplerate\": %d, \"channels\": %d, "
+            "\"bext_time_reference\": %" PRIu64, sndfinfo.samplerate, sndchans, time_reference);
+    }
+    fprintf(timing_fp, "}\n");
+    fflush(timing_fp);
+}
 
-#define ISPOW2(x) ((x) > 0 && !((x) & (x-1)))
-int nextpow2(int x) {
-    if(ISPOW2(x)) {
-        return x;
+/* with --timecode, once the first frame's time is known stamp the file
+ * with it, and then every timecode_secs note how the clocks are drifting */
+void update_timecode(uint64_t nframes_to_file) {
+    static struct timespec last_marker;
+    jack_time_t usecs;
+    uint64_t time_reference = 0;
+
+    // keep up with jack_process's anchors, so their ring doesn't fill
+    timing_jack_frame(nframes_to_file);
+    if(!timecode_started) {
+        if(has_bext) {
+            time_reference = set_bext(frame_wall_ns(run_start_frame, &usecs));
+        }
+        write_timing_marker("start", 0, time_reference);
+        clock_gettime(CLOCK_MONOTONIC, &last_marker);
+        timecode_started = true;
+    }
+    else if(nframes_to_file > 0 && elapsed_msecs(&last_marker) >= 1e3 * timecode_secs) {
+        write_timing_marker("drift", nframes_to_file, 0);
+        clock_gettime(CLOCK_MONOTONIC, &last_marker);
     }
-    int power = 2;
-    while (x >>= 1) power <<= 1;
-    return (int)(1 << power);
 }
 
 void *fileio_function(void *ptr) {
@@ -70,189 +1170,892 @@ void *fileio_function(void *ptr) {
     // return  ptr;
     int nframes_write_available, nframes_read_available;
     int nframes_read, nframes_written;
+    uint64_t nframes_to_file = 0;
+    struct timespec now, last_sync, io_start;
 
     ptr = ptr; // mollify compiler
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
 
     while(1) {
-        if(sndmode == PLAY_MODE) {
+        // once asked to stop, go around once more so REC_MODE drains the ring
+        bool stopping = atomic_load_explicit(&fileio_stop, memory_order_acquire);
+
+        if(CPU_COUNT(&fileio_cpus) > 0 || avoid_jack_cpu) {
+            update_fileio_affinity();
+        }
+
+        if(sndmode == PLAY_MODE && stopping) {
+            // nothing left to play to
+        }
+        else if(sndmode == PLAY_MODE && readahead_nblocks > 0) {
+            feed_from_readahead();
+        }
+        else if(sndmode == PLAY_MODE) {
             nframes_write_available = 
                 PaUtil_GetRingBufferWriteAvailable(pa_ringbuf);
+            if(nframes_write_available > JACK_PLAY_RECORD_MAX_FRAMES) {
+                nframes_write_available = JACK_PLAY_RECORD_MAX_FRAMES;
+            }
             if( nframes_write_available > 0 && (repetitions==0 || repetitions_finished < repetitions) ) {
                 // read data from sndf in to interleaved buffer
-                nframes_read = sf_readf_float(sndf, &(linbufFILE[0]), nframes_write_available);
+                clock_gettime(CLOCK_MONOTONIC, &io_start);
+                nframes_read = file_readf(&(linbufFILE[0]), nframes_write_available);
+                record_disk_latency(&io_start);
                 if(nframes_read < nframes_write_available ) {
-                    sf_seek(sndf, 0, SEEK_SET); // rewind to beginning of file
+                    file_rewind(); // rewind to beginning of file
                     repetitions_finished += 1;
                 }
                 nframes_written = PaUtil_WriteRingBuffer(pa_ringbuf, &(linbufFILE[0]), nframes_read);
             }
             else {
-		memset((void *)(&(linbufFILE[0])), 0, sizeof(linbufFILE));
+		memset((void *)(&(linbufFILE[0])), 0,
+                    sizeof(jack_default_audio_sample_t) * sndchans * nframes_write_available);
                 nframes_written = PaUtil_WriteRingBuffer(pa_ringbuf, &(linbufFILE[0]), nframes_write_available);
 	    }
         }
 
+        else if(sndmode == REC_MODE && stream_fd >= 0) {
+            stream_out();
+        }
+
         else if(sndmode == REC_MODE) {
-            nframes_read_available = PaUtil_GetRingBufferReadAvailable(pa_ringbuf);
-            if( nframes_read_available > 0) {
+            // drain everything that's there, a linbufFILE at a time
+            while((nframes_read_available = PaUtil_GetRingBufferReadAvailable(pa_ringbuf)) > 0) {
+                if(nframes_read_available > JACK_PLAY_RECORD_MAX_FRAMES) {
+                    nframes_read_available = JACK_PLAY_RECORD_MAX_FRAMES;
+                }
                 nframes_read = PaUtil_ReadRingBuffer(
                     pa_ringbuf, &(linbufFILE[0]), nframes_read_available);
-                nframes_written = sf_writef_float(sndf, &(linbufFILE[0]), nframes_read);
+                if(tap != NULL) {
+                    write_tap(linbufFILE, nframes_read);
+                }
+                if(timing_fp != NULL) {
+                    update_timecode(nframes_to_file);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &io_start);
+                nframes_written = file_writef(&(linbufFILE[0]), nframes_read);
+                record_disk_latency(&io_start);
                 if(nframes_read != nframes_written) {
-                    printf("\nWRN: in fileio_function / REC_MODE\n    nframes_read(from ring buffer)=%d\n    nframes_written(to file)=%d\n",
+                    JC_LOG("WRN: in fileio_function / REC_MODE, nframes_read(from ring buffer)=%d, nframes_written(to file)=%d\n",
                             nframes_read, nframes_written);
                 }
+                nframes_to_file += nframes_written > 0 ? nframes_written : 0;
+            }
+
+            if(sync_interval_secs > 0.0 &&
+               nframes_to_file > atomic_load_explicit(&written_nframes, memory_order_relaxed)) {
+                atomic_store_explicit(&written_nframes, nframes_to_file, memory_order_release);
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if((now.tv_sec - last_sync.tv_sec) + 1e-9 * (now.tv_nsec - last_sync.tv_nsec)
+                        >= sync_interval_secs) {
+                    // only a few bytes in the page cache, the sync itself is sync_thread's
+                    sf_command(sndf, SFC_UPDATE_HEADER_NOW, NULL, 0);
+                    atomic_store_explicit(&header_nframes, nframes_to_file, memory_order_release);
+                    last_sync = now;
+                }
+                sem_post(&sync_sem);
             }
         }
 
         else{
             /* FIXME, catch this error */
         }
-        usleep(85000); // 85k ~ 16k (buf) / 192k (max rate) * 1e6 (usecs) // sched_yield();
+
+        if(stopping) {
+            if(timing_fp != NULL && timecode_started) {
+                write_timing_marker("end", nframes_to_file, 0);
+            }
+            return NULL;
+        }
+        if(atomic_load_explicit(&freewheeling, memory_order_acquire)) {
+            // jack_process is waiting on us, not on the clock
+            jc_handoff_post(&ring_moved);
+            jc_handoff_wait(&fileio_wake, FILEIO_MIN_POLL_USECS);
+            continue;
+        }
+        adapt_fileio_poll();
+        usleep(fileio_poll_usecs); // sched_yield();
     } // end while(1)
 }
 
 int waiting_check(void) {
-    int cidx, connectedchans = 0;
-    // if waitchans > 0, let's wait until waitchans channels have been connected
+    // if waitchans > 0, let's wait until waitchans channels have been connected;
+    // connected_ports is kept up to date by jack_port_connect
     if(waitchans > 0) {
-        /* count number of connected channels */
-        for(cidx=0; cidx<sndchans; cidx++) {
-            if(sndmode == PLAY_MODE) {
-                connectedchans += jack_port_connected(jackout_ports[cidx]) ? 1 : 0;
+        return atomic_load_explicit(&connected_ports, memory_order_acquire) < waitchans;
+    }
+    return 0;
+}
+
+/**
+ * JACK calls this from its notification thread (not the process thread)
+ * whenever any two ports are connected or disconnected.  Recount which of
+ * our ports have connections, for -w.
+ */
+void jack_port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void *arg) {
+    int cidx, nconnected = 0;
+    uint64_t mask = 0;
+    jack_port_t *port;
+
+    // silence compiler
+    a = a;
+    b = b;
+    connect = connect;
+    arg = arg;
+
+    for(cidx=0; cidx<nports; cidx++) {
+        port = sndmode == PLAY_MODE ? jackout_ports[cidx] : jackin_ports[cidx];
+        if(jack_port_connected(port)) {
+            nconnected++;
+            mask |= (uint64_t)1 << cidx;
+        }
+    }
+    atomic_store_explicit(&connected_mask, mask, memory_order_release);
+    atomic_store_explicit(&connected_ports, nconnected, memory_order_release);
+}
+
+/* connect our ports, in order, to the ports matching connect_pattern, or
+ * to the physical ports when the pattern is "physical" */
+void auto_connect(void) {
+    const char **ports;
+    const char *pattern = connect_pattern;
+    unsigned long flags;
+    int cidx, nmatched, nconnected = 0;
+
+    // the other end of a playback port is an input, and vice versa
+    flags = sndmode == PLAY_MODE ? JackPortIsInput : JackPortIsOutput;
+    if(0 == strcmp(connect_pattern, "physical")) {
+        flags |= JackPortIsPhysical;
+        pattern = NULL;
+    }
+
+    ports = jack_get_ports(client, pattern, JACK_DEFAULT_AUDIO_TYPE, flags);
+    if(ports == NULL) {
+        printf("WRN: no ports match '%s', not connecting anything\n", connect_pattern);
+        return;
+    }
+    for(nmatched=0; ports[nmatched] != NULL; nmatched++);
+
+    for(cidx=0; cidx<nports && cidx<nmatched; cidx++) {
+        int err;
+        if(sndmode == PLAY_MODE) {
+            err = jack_connect(client, jack_port_name(jackout_ports[cidx]), ports[cidx]);
+        }
+        else {
+            err = jack_connect(client, ports[cidx], jack_port_name(jackin_ports[cidx]));
+        }
+        if(err) {
+            printf("WRN: could not connect channel %d to %s\n", cidx+1, ports[cidx]);
+        }
+        else {
+            nconnected++;
+        }
+    }
+    printf("INFO: connected %d of %d channels to ports matching '%s'\n",
+        nconnected, nports, connect_pattern);
+
+    jack_free(ports);
+}
+
+
+/* parse a --start-at or --duration spec: a number of frames, or of seconds
+ * or milliseconds when it ends in s or ms; with prefixes, --start-at's
+ * spec may be +N (after we're ready) or @N (transport position), and is
+ * an absolute jack frame time without one.  Returns 0 on success. */
+int parse_time_spec(const char *spec, jack_nframes_t rate, bool allow_prefix,
+                    int *mode, int64_t *nframes) {
+    char *unit;
+    double amount;
+
+    *(mode) = START_FRAME_TIME;
+    if(allow_prefix && (spec[0] == '+' || spec[0] == '@')) {
+        *(mode) = spec[0] == '+' ? START_RELATIVE : START_TRANSPORT;
+        spec++;
+    }
+
+    amount = strtod(spec, &unit);
+    if(unit == spec || amount < 0.0) {
+        return 1;
+    }
+    if(0 == strcmp(unit, "s")) {
+        amount *= rate;
+    }
+    else if(0 == strcmp(unit, "ms")) {
+        amount *= rate / 1000.0;
+    }
+    else if(unit[0] != 0 && 0 != strcmp(unit, "f")) {
+        return 1;
+    }
+    *(nframes) = (int64_t)(amount + 0.5);
+    return 0;
+}
+
+/* Work out which frames of this cycle to play or record, for --start-at
+ * and --duration, as [*offset, *offset + *count).  Returns 0 when there
+ * are none. */
+static int scheduled_window(jack_nframes_t nframes, jack_nframes_t *offset, jack_nframes_t *count) {
+    jack_nframes_t now;
+    jack_position_t pos;
+    int64_t ahead = 0; // from the start of this cycle to the start time
+    uint64_t left;
+
+    if(atomic_load_explicit(&run_finished, memory_order_relaxed)) {
+        return 0;
+    }
+
+    *(offset) = 0;
+    if(!atomic_load_explicit(&run_started, memory_order_relaxed)) {
+        now = jack_last_frame_time(client);
+        switch(start_mode) {
+            case START_RELATIVE:
+                // anchored to the first cycle we're free to run in
+                start_value = (int64_t)(now + (jack_nframes_t)start_value);
+                start_mode = START_FRAME_TIME;
+                /* fall through */
+            case START_FRAME_TIME:
+                ahead = (int32_t)((jack_nframes_t)start_value - now); // wraps safely
+                break;
+            case START_TRANSPORT:
+                if(jack_transport_query(client, &pos) != JackTransportRolling) {
+                    return 0;
+                }
+                ahead = start_value - (int64_t)pos.frame;
+                break;
+            default:
+                break;
+        }
+        if(ahead >= (int64_t)nframes) {
+            return 0;
+        }
+        // a start time already in the past starts right away
+        *(offset) = ahead > 0 ? (jack_nframes_t)ahead : 0;
+        run_start_frame = now + *(offset);
+        clock_gettime(CLOCK_MONOTONIC, &first_cycle_time);
+        first_cycle_offset = *(offset);
+        atomic_store_explicit(&run_started, true, memory_order_release);
+    }
+
+    *(count) = nframes - *(offset);
+    if(duration_nframes > 0) {
+        left = duration_nframes - run_nframes_done;
+        if(left <= *(count)) {
+            *(count) = (jack_nframes_t)left;
+            atomic_store_explicit(&run_finished, true, memory_order_release);
+        }
+    }
+    run_nframes_done += *(count);
+    return *(count) > 0;
+}
+
+/* while freewheeling, hold the cycle until ring has room for (REC_MODE), or
+ * holds (PLAY_MODE), nframes; gives up after FREEWHEEL_STALL_USECS without
+ * progress */
+void freewheel_wait(PaUtilRingBuffer *ring, int mode, jack_nframes_t nframes) {
+    ring_buffer_size_t ready, last_ready = -1;
+    uint64_t now, last_progress = jc_now_ns();
+
+    while(!atomic_load_explicit(&fileio_stop, memory_order_acquire)) {
+        ready = mode == PLAY_MODE ?
+            PaUtil_GetRingBufferReadAvailable(ring) :
+            PaUtil_GetRingBufferWriteAvailable(ring);
+        if(ready >= (ring_buffer_size_t)nframes) {
+            return;
+        }
+        // only the file side moves the ring while this thread waits
+        now = jc_now_ns();
+        if(ready != last_ready) {
+            last_ready = ready;
+            last_progress = now;
+        }
+        else if(now - last_progress >= (uint64_t)FREEWHEEL_STALL_USECS * 1000) {
+            JC_LOG("WRN: freewheeling, but the ring hasn't moved in %d msecs\n",
+                FREEWHEEL_STALL_USECS / 1000);
+            return;
+        }
+        jc_handoff_post(&fileio_wake);
+        jc_handoff_wait(&ring_moved, FREEWHEEL_STALL_USECS);
+    }
+}
+
+/* Which ports are worth touching this cycle.  jack_port_connect's mask
+ * only catches up once jack's notification thread has run, after a new
+ * connection is already live, so it's a hint: a port it has as unconnected
+ * is asked directly, and its first cycles aren't recorded as silence, or
+ * played to nobody. */
+static uint64_t live_port_mask(void) {
+    uint64_t mask = atomic_load_explicit(&connected_mask, memory_order_acquire);
+    int cidx;
+
+    for(cidx=0; cidx<nports; cidx++) {
+        if(!(mask & ((uint64_t)1 << cidx)) &&
+           jack_port_connected(sndmode == PLAY_MODE ? jackout_ports[cidx] : jackin_ports[cidx])) {
+            mask |= (uint64_t)1 << cidx;
+        }
+    }
+    return mask;
+}
+
+/**
+ * The process callback for this JACK application is called in a
+ * special realtime thread once for each audio cycle.
+ *
+ * This client uses a PortAudio ringbuffer as buffer "in RAM"
+ * Reading from the disk directly in the jack process callback
+ * will likely yield dropouts, and we want to avoid that.
+ */
+int jack_process (jack_nframes_t nframes, void *arg)
+{
+    int cidx;
+    jack_nframes_t nframes_read, nframes_written;
+    jack_nframes_t offset = 0, count = 0;
+    uint64_t mask = live_port_mask();
+    static uint64_t last_mask = 0;
+    uint64_t cycle_start = 0, stage_start = 0;
+    jack_default_audio_sample_t *jackbufs[JACK_PLAY_RECORD_MAX_PORTS];
+
+    if(profiling) {
+        cycle_start = stage_start = jc_now_ns();
+    }
+
+    // an output we stop writing keeps its last buffer; make that silence,
+    // so it's all anyone hears if they connect before we notice them
+    if(sndmode == PLAY_MODE && (last_mask & ~mask)) {
+        for(cidx=0; cidx<nports; cidx++) {
+            if((last_mask & ~mask) & ((uint64_t)1 << cidx)) {
+                memset(jack_port_get_buffer(jackout_ports[cidx], nframes), 0,
+                    sizeof(jack_default_audio_sample_t) * nframes);
+            }
+        }
+    }
+    last_mask = mask;
+
+    if(avoid_jack_cpu) {
+        atomic_store_explicit(&jack_cpu, sched_getcpu(), memory_order_relaxed);
+    }
+
+    if(keep_waiting || !scheduled_window(nframes, &offset, &count)) {
+        // don't touch ringbuffer, and nothing will happen re: the file
+        if(sndmode == PLAY_MODE) {
+            for(cidx=0; cidx<nports; cidx++) {
+                if(!(mask & ((uint64_t)1 << cidx))) {
+                    continue;
+                }
+                jack_default_audio_sample_t *jackbuf = jack_port_get_buffer(jackout_ports[cidx], nframes);
+                memset(jackbuf, 0, sizeof(jack_default_audio_sample_t) * nframes);
             }
-            else if(sndmode == REC_MODE) {
-                connectedchans += jack_port_connected(jackin_ports[cidx]) ? 1 : 0;
+        }
+
+        if(keep_waiting) {
+            keep_waiting = waiting_check();
+        }
+        profile_lap(PROFILE_CYCLE, &cycle_start);
+        return 0;
+    }
+
+
+    // silence compiler
+    arg = arg;
+    // not realtime any more, so this thread may wait on the disk
+    bool waiting = atomic_load_explicit(&freewheeling, memory_order_acquire);
+    if(waiting) {
+        freewheel_wait(pa_ringbuf, sndmode, count);
+    }
+    // jack_default_audio_sample_t *in, *out;
+    if(sndmode == PLAY_MODE) {
+
+        // read from pa_ringbuf
+        nframes_read = PaUtil_ReadRingBuffer(
+            pa_ringbuf, &(linbufJACK[0]), count);
+        if(nframes_read != count) {
+            JC_LOG("WRN: underflow reading from pa_ringbuf, %u of %u frames played as silence\n",
+                count - nframes_read, count);
+            memset(&(linbufJACK[nframes_read * sndchans]), 0,
+                sizeof(jack_default_audio_sample_t) * (count - nframes_read) * sndchans);
+        }
+        profile_lap(PROFILE_RING, &stage_start);
+
+        // get jack buffers as needed (NULL where nobody is listening), with
+        // silence outside of the scheduled frames
+        jc_port_buffers(jackbufs, jackout_ports, nports, mask, nframes);
+        for(cidx=0; cidx<nports; cidx++) {
+            if(jackbufs[cidx] == NULL) {
+                continue;
             }
-            else {
-                /* FIXME catch error */
+            memset(jackbufs[cidx], 0, sizeof(jack_default_audio_sample_t) * offset);
+            memset(jackbufs[cidx] + offset + count, 0,
+                sizeof(jack_default_audio_sample_t) * (nframes - offset - count));
+        }
+        profile_lap(PROFILE_PORTS, &stage_start);
+
+        // and write directly in to those buffers; only the file channels
+        // that -o picked are deinterleaved
+        jc_deinterleave(jackbufs, linbufJACK, sndchans, channel_map, nports, offset, count);
+        profile_lap(PROFILE_INTERLEAVE, &stage_start);
+    } // end PLAY_MODE
+
+    else if(sndmode == REC_MODE) {
+        // get pointers for the connected jack port buffers; unconnected ones
+        // record silence from zeros without asking jack for anything
+        jc_port_buffers(jackbufs, jackin_ports, sndchans, mask, nframes);
+        for(cidx=0; cidx<sndchans; cidx++) {
+            jackbufs[cidx] = jackbufs[cidx] != NULL ? jackbufs[cidx] : zeros;
+        }
+        profile_lap(PROFILE_PORTS, &stage_start);
+
+        jc_interleave(linbufJACK, jackbufs, sndchans, offset, count);
+        profile_lap(PROFILE_INTERLEAVE, &stage_start);
+
+        nframes_written = PaUtil_WriteRingBuffer(
+            pa_ringbuf, &(linbufJACK[0]), count);
+        if( nframes_written != count) {
+            JC_LOG("WRN: overflow writing to pa_ringbuf, %u of %u frames lost\n",
+                count - nframes_written, count);
+        }
+        if(timing_fp != NULL) {
+            note_timing_anchor(jack_last_frame_time(client) + offset, nframes_written, count - nframes_written);
+        }
+        profile_lap(PROFILE_RING, &stage_start);
+    } // end REC_MODE
+
+    else {
+        /* FIXME, catch this error */
+    }
+
+    if(waiting) {
+        // top up or drain now, rather than when the next cycle asks
+        jc_handoff_post(&fileio_wake);
+    }
+    profile_lap(PROFILE_CYCLE, &cycle_start);
+    return 0;
+}
+
+
+
+
+/**
+ * JACK calls this shutdown_callback if the server ever shuts down or
+ * decides to disconnect the client.
+ */
+void jack_shutdown (void *arg)
+{
+    arg=arg; /* silence compiler */
+    // main notices this, and still drains the ring and finishes the file
+    atomic_store_explicit(&server_shutdown, true, memory_order_release);
+}
+
+/**
+ * JACK calls this when freewheeling starts or stops; see freewheel_wait.
+ */
+void jack_freewheel (int starting, void *arg)
+{
+    arg=arg; /* silence compiler */
+    atomic_store_explicit(&freewheeling, starting != 0, memory_order_release);
+    jc_handoff_post(&fileio_wake);
+    JC_LOG("INFO: freewheeling %s\n", starting ? "started" : "stopped");
+}
+
+/* carve size bytes, cache line aligned, out of the daemon's slab */
+void *pool_alloc(size_t size) {
+    void *ptr;
+
+    size = (size + 63) & ~((size_t)63);
+    if(daemon_pool_used + size > daemon_pool_size) {
+        return NULL;
+    }
+    ptr = daemon_pool + daemon_pool_used;
+    daemon_pool_used += size;
+    return ptr;
+}
+
+/* Read the -d session file, one session per line:
+ *     play NAME FILE [REPETITIONS]
+ *     record NAME FILE CHANNELS
+ * with blank lines and lines starting with # ignored.  Returns 0 on success. */
+int read_session_file(const char *fname) {
+    FILE *fp = fopen(fname, "r");
+    char line[SND_FNAME_SIZE + 256], verb[16];
+    int lineno = 0, number, nfields;
+
+    if(fp == NULL) {
+        printf("Error, could not open session file %s (%s)\n", fname, strerror(errno));
+        return 1;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        jpr_session_t *sess = &(daemon_sessions[daemon_nsessions]);
+        lineno++;
+        if(line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#') {
+            continue;
+        }
+        if(daemon_nsessions == DAEMON_MAX_SESSIONS) {
+            printf("Error, %s has more than %d sessions\n", fname, DAEMON_MAX_SESSIONS);
+            fclose(fp);
+            return 1;
+        }
+        number = 0;
+        nfields = sscanf(line, "%15s %63s %2047s %d", verb, sess->name, sess->fname, &number);
+        if(nfields >= 3 && 0 == strcmp(verb, "play")) {
+            sess->mode = PLAY_MODE;
+            sess->repetitions = number;
+        }
+        else if(nfields == 4 && 0 == strcmp(verb, "record") &&
+                number > 0 && number <= JACK_PLAY_RECORD_MAX_PORTS) {
+            sess->mode = REC_MODE;
+            sess->chans = number;
+        }
+        else {
+            printf("Error, %s:%d: expected 'play NAME FILE [REPETITIONS]' or 'record NAME FILE CHANNELS'\n",
+                fname, lineno);
+            fclose(fp);
+            return 1;
+        }
+        atomic_flag_clear(&(sess->busy));
+        daemon_nsessions++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* the fraction of a session's ring ready for the jack thread, as in adapt_fileio_poll */
+double session_headroom(jpr_session_t *sess) {
+    int avail = sess->mode == PLAY_MODE ?
+        PaUtil_GetRingBufferReadAvailable(&(sess->ring)) :
+        PaUtil_GetRingBufferWriteAvailable(&(sess->ring));
+    return (double)avail / sess->ring_capacity;
+}
+
+/* one chunk of file i/o for a session, with buf as scratch; returns the
+ * number of frames moved */
+int service_session(jpr_session_t *sess, jack_default_audio_sample_t *buf) {
+    int nframes = 0, nframes_read, nframes_written;
+
+    if(sess->mode == PLAY_MODE) {
+        if(atomic_load_explicit(&(sess->eof), memory_order_relaxed)) {
+            return 0; // played out, daemon_process lets the ring run dry
+        }
+        nframes = PaUtil_GetRingBufferWriteAvailable(&(sess->ring));
+        nframes = nframes > JACK_PLAY_RECORD_MAX_FRAMES ? JACK_PLAY_RECORD_MAX_FRAMES : nframes;
+        if(nframes == 0) {
+            return 0;
+        }
+        nframes_read = sf_readf_float(sess->sndf, buf, nframes);
+        nframes_written = PaUtil_WriteRingBuffer(&(sess->ring), buf, nframes_read);
+        if(nframes_read < nframes) {
+            sf_seek(sess->sndf, 0, SEEK_SET);
+            sess->repetitions_finished += 1;
+            if(sess->repetitions > 0 && sess->repetitions_finished >= sess->repetitions) {
+                // after the last frames, so daemon_process sees them first
+                atomic_store_explicit(&(sess->eof), true, memory_order_release);
             }
         }
-        /* if connected channels is large enough, 
-        break out of this loop and start playing/recording */
-        if(connectedchans >= waitchans) {
+        return nframes_written;
+    }
+    else {
+        nframes = PaUtil_GetRingBufferReadAvailable(&(sess->ring));
+        nframes = nframes > JACK_PLAY_RECORD_MAX_FRAMES ? JACK_PLAY_RECORD_MAX_FRAMES : nframes;
+        if(nframes == 0) {
             return 0;
         }
+        nframes = PaUtil_ReadRingBuffer(&(sess->ring), buf, nframes);
+        if(sf_writef_float(sess->sndf, buf, nframes) != nframes) {
+            JC_LOG("WRN: short write to %s\n", sess->fname);
+        }
+        return nframes;
+    }
+}
+
+/**
+ * Each of the daemon's i/o threads repeatedly picks the session whose ring
+ * is closest to running dry (playing) or over (recording) that no other
+ * thread has claimed, and gives it one chunk of i/o.  When every session
+ * has at least half its ring in hand, the thread naps.
+ */
+void *daemon_io_function(void *ptr) {
+    jack_default_audio_sample_t *buf = ptr;
+    jpr_session_t *sess, *urgent;
+    double headroom, least, least_all;
+    int sidx;
+    bool stopping;
+
+    while(1) {
+        stopping = atomic_load_explicit(&fileio_stop, memory_order_acquire);
+        urgent = NULL;
+        least = least_all = 2.0;
+        for(sidx=0; sidx<daemon_nsessions; sidx++) {
+            sess = &(daemon_sessions[sidx]);
+            if(sess->mode == PLAY_MODE &&
+               (stopping || atomic_load_explicit(&(sess->eof), memory_order_relaxed))) {
+                continue; // nothing more to read for it
+            }
+            headroom = session_headroom(sess);
+            least_all = headroom < least_all ? headroom : least_all;
+            if(headroom < least && (headroom < 1.0 || stopping) &&
+               !atomic_flag_test_and_set_explicit(&(sess->busy), memory_order_acquire)) {
+                if(urgent) {
+                    atomic_flag_clear_explicit(&(urgent->busy), memory_order_release);
+                }
+                urgent = sess;
+                least = headroom;
+            }
+        }
+
+        if(urgent) {
+            int moved = service_session(urgent, buf);
+            atomic_flag_clear_explicit(&(urgent->busy), memory_order_release);
+            if(moved > 0) {
+                if(atomic_load_explicit(&freewheeling, memory_order_acquire)) {
+                    jc_handoff_post(&ring_moved);
+                }
+                continue;
+            }
+        }
+        if(stopping) {
+            // nothing left to drain that isn't someone else's
+            return NULL;
+        }
+        if(atomic_load_explicit(&freewheeling, memory_order_acquire)) {
+            // daemon_process is waiting on us, not on the clock
+            jc_handoff_post(&ring_moved);
+            jc_handoff_wait(&fileio_wake, FILEIO_MIN_POLL_USECS);
+            continue;
+        }
+        // nap only when every ring, claimed by another thread or not, is at
+        // least half in hand; otherwise there's work about to need doing
+        if(least_all > 0.5) {
+            usleep(fileio_poll_usecs);
+        }
         else {
-            return 1;
+            sched_yield();
         }
     }
-    return 0;
 }
 
-
-/**
- * The process callback for this JACK application is called in a
- * special realtime thread once for each audio cycle.
- *
- * This client uses a PortAudio ringbuffer as buffer "in RAM"
- * Reading from the disk directly in the jack process callback
- * will likely yield dropouts, and we want to avoid that.
- */
-int jack_process (jack_nframes_t nframes, void *arg)
-{
-    int cidx, sidx;
-    jack_nframes_t fidx, nframes_read_available, nframes_write_available;
-    jack_nframes_t nframes_read, nframes_written;
-
-    if(keep_waiting) {
-        // don't touch ringbuffer, and nothing will happen re: the file
-        if(sndmode == PLAY_MODE) {
-            for(cidx=0; cidx<sndchans; cidx++) {
-                jack_default_audio_sample_t *jackbuf = jack_port_get_buffer(jackout_ports[cidx], nframes);
-                for(fidx=0; fidx<nframes; fidx++) {
-                    *(jackbuf++) = 0.0;
+/* the daemon's process callback, each session in turn, as jack_process does for one */
+int daemon_process(jack_nframes_t nframes, void *arg) {
+    jack_default_audio_sample_t *jackbufs[JACK_PLAY_RECORD_MAX_PORTS];
+    jpr_session_t *sess;
+    jack_nframes_t nframes_read;
+    int sidx;
+    bool waiting = atomic_load_explicit(&freewheeling, memory_order_acquire), eof;
+
+    arg = arg; // silence compiler
+
+    for(sidx=0; sidx<daemon_nsessions; sidx++) {
+        sess = &(daemon_sessions[sidx]);
+        if(sess->mode == PLAY_MODE) {
+            nframes_read = 0;
+            if(!atomic_load_explicit(&(sess->done), memory_order_relaxed)) {
+                // eof before the ring, so a short read after it really is the end
+                eof = atomic_load_explicit(&(sess->eof), memory_order_acquire);
+                if(waiting && !eof) {
+                    freewheel_wait(&(sess->ring), PLAY_MODE, nframes);
+                }
+                nframes_read = PaUtil_ReadRingBuffer(&(sess->ring), linbufJACK, nframes);
+                if(nframes_read != nframes && eof) {
+                    atomic_store_explicit(&(sess->done), true, memory_order_relaxed);
+                    JC_LOG("INFO: session %s finished playing\n", sess->name);
+                }
+                else if(nframes_read != nframes) {
+                    JC_LOG("WRN: underflow in session %s, %u of %u frames played as silence\n",
+                        sess->name, nframes - nframes_read, nframes);
                 }
             }
+            memset(&(linbufJACK[nframes_read * sess->chans]), 0,
+                sizeof(jack_default_audio_sample_t) * (nframes - nframes_read) * sess->chans);
+            jc_port_buffers(jackbufs, sess->ports, sess->chans, ~(uint64_t)0, nframes);
+            jc_deinterleave(jackbufs, linbufJACK, sess->chans, NULL, sess->chans, 0, nframes);
         }
-        else if(sndmode == REC_MODE) {
-            for(cidx=0; cidx<sndchans; cidx++) {
-                // is it necessary to do anything here?
-                // jack_default_audio_sample_t *jackbuf = jack_port_get_buffer(jackin_ports[cidx], nframes);
+        else {
+            jc_port_buffers(jackbufs, sess->ports, sess->chans, ~(uint64_t)0, nframes);
+            jc_interleave(linbufJACK, jackbufs, sess->chans, 0, nframes);
+            if(waiting) {
+                freewheel_wait(&(sess->ring), REC_MODE, nframes);
+            }
+            if(PaUtil_WriteRingBuffer(&(sess->ring), linbufJACK, nframes) != (ring_buffer_size_t)nframes) {
+                JC_LOG("WRN: overflow in session %s, frames lost\n", sess->name);
             }
         }
+    }
+    if(waiting) {
+        jc_handoff_post(&fileio_wake);
+    }
+    return 0;
+}
 
-        keep_waiting = waiting_check();
-        return 0;
+/* whether every session is a playback that has finished */
+bool daemon_finished(void) {
+    int sidx;
+
+    for(sidx=0; sidx<daemon_nsessions; sidx++) {
+        if(daemon_sessions[sidx].mode == REC_MODE ||
+           !atomic_load_explicit(&(daemon_sessions[sidx].done), memory_order_relaxed)) {
+            return false;
+        }
     }
+    return true;
+}
 
+/* -d: open every session in daemon_fname on one jack client and run them
+ * until SIGINT or SIGTERM, or every session is a playback that has finished,
+ * with the same stop sequence as a single session */
+int run_daemon(const sigset_t *stopmask) {
+    pthread_t io_threads[DAEMON_MAX_THREADS];
+    pthread_attr_t io_attr;
+    struct sched_param io_param;
+    jack_nframes_t rate;
+    char portname[JACK_PORT_NAME_SIZE];
+    size_t chunk_bytes;
+    int sidx, tidx, c, err, max_chans = 0, min_capacity = 0, nstarted = 0, ret = 1;
+    bool active = false;
+
+    if(read_session_file(daemon_fname) || daemon_nsessions == 0) {
+        printf("Error, no sessions to run from %s\n", daemon_fname);
+        return 1;
+    }
+    daemon_nthreads = daemon_nthreads < 1 ? 1 : daemon_nthreads;
+    daemon_nthreads = daemon_nthreads > DAEMON_MAX_THREADS ? DAEMON_MAX_THREADS : daemon_nthreads;
 
-    // silence compiler
-    arg = arg;
-    // jack_default_audio_sample_t *in, *out;
-    if(sndmode == PLAY_MODE) {
+    client = jc_client_open(jackname, JACK_CLIENT_NAME_SIZE);
+    if(client == NULL) {
+        return 1;
+    }
+    rate = jack_get_sample_rate(client);
 
-        // read from pa_ringbuf
-        nframes_read_available = PaUtil_GetRingBufferReadAvailable(pa_ringbuf);
-        if(nframes_read_available < nframes) {
-            /* FIXME, report underflow */
-            /* FIXME, zero out (nframes - nframes_to_read) number of frames 
-                in linbufJACK */
+    // open the files first, so the slab can be sized in one go
+    for(sidx=0; sidx<daemon_nsessions; sidx++) {
+        jpr_session_t *sess = &(daemon_sessions[sidx]);
+        if(sess->mode == PLAY_MODE) {
+            sess->info.format = 0;
         }
-        nframes_read = PaUtil_ReadRingBuffer(
-            pa_ringbuf, &(linbufJACK[0]), nframes);
-        if(nframes_read != nframes) {
-            printf("Underflow reading from pa_ringbuf\n");
+        else {
+            sess->info.samplerate = rate;
+            sess->info.channels = sess->chans;
+            sess->info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+        }
+        sess->sndf = sf_open(sess->fname, sess->mode, &(sess->info));
+        if(sess->sndf == NULL) {
+            printf("Error, session %s could not open %s (%s)\n", sess->name, sess->fname, sf_strerror(NULL));
+            goto done;
         }
+        sess->chans = sess->info.channels;
+        if(sess->chans > JACK_PLAY_RECORD_MAX_PORTS) {
+            printf("Error, session %s has more than %d channels\n", sess->name, JACK_PLAY_RECORD_MAX_PORTS);
+            goto done;
+        }
+        sess->ring_capacity = ring_frames_for(rate, jack_get_buffer_size(client), 0.0);
+        max_chans = sess->chans > max_chans ? sess->chans : max_chans;
+        min_capacity = min_capacity == 0 || sess->ring_capacity < min_capacity ? sess->ring_capacity : min_capacity;
+        daemon_pool_size += sizeof(jack_default_audio_sample_t) * sess->chans * sess->ring_capacity + 64;
+    }
+    chunk_bytes = sizeof(jack_default_audio_sample_t) * max_chans * JACK_PLAY_RECORD_MAX_FRAMES + 64;
+    daemon_pool_size += chunk_bytes * (daemon_nthreads + 1);
 
-        // get jack buffers as needed, and write directly in to those buffers
-        for(cidx=0; cidx<sndchans; cidx++) {
-            jack_default_audio_sample_t *jackbuf = jack_port_get_buffer(jackout_ports[cidx], nframes);
-            for(fidx=0; fidx<nframes; fidx++) {
-                *(jackbuf++) = linbufJACK[(fidx*sndchans) + cidx];
-            }
+    daemon_pool = malloc(daemon_pool_size);
+    if(daemon_pool == NULL) {
+        printf("Error, could not allocate %zu bytes of buffers\n", daemon_pool_size);
+        goto done;
+    }
+    if(lock_memory == LOCK_MEMORY_ALL && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        printf("WRN: could not mlockall (%s), check ulimit -l\n", strerror(errno));
+    }
+    if(lock_memory != LOCK_MEMORY_NONE) {
+        prefault_and_lock(daemon_pool, daemon_pool_size, "the buffer pool");
+    }
+    linbufJACK = pool_alloc(chunk_bytes);
+
+    for(sidx=0; sidx<daemon_nsessions; sidx++) {
+        jpr_session_t *sess = &(daemon_sessions[sidx]);
+        PaUtil_InitializeRingBuffer(&(sess->ring),
+            sizeof(jack_default_audio_sample_t) * sess->chans, sess->ring_capacity,
+            pool_alloc(sizeof(jack_default_audio_sample_t) * sess->chans * sess->ring_capacity));
+        snprintf(portname, JACK_PORT_NAME_SIZE, "%.*s_%s", SESSION_NAME_SIZE - 1, sess->name,
+            sess->mode == PLAY_MODE ? "out" : "in");
+        if(jc_register_ports(client, sess->ports, sess->chans, portname,
+                sess->mode == PLAY_MODE ? JackPortIsOutput : JackPortIsInput)) {
+            printf("Error, could not register the ports of session %s\n", sess->name);
+            goto done;
         }
-    } // end PLAY_MODE
+        // preload, so playback doesn't start with an underrun
+        while(sess->mode == PLAY_MODE && service_session(sess, linbufJACK) > 0);
+    }
+    printf("INFO: %d sessions, %d i/o threads, %.1f KiB of buffers\n",
+        daemon_nsessions, daemon_nthreads, daemon_pool_size / 1024.0);
+
+    // wake often enough for the smallest ring
+    fileio_poll_usecs = (int)(250000.0 * min_capacity / rate);
+    fileio_poll_usecs = fileio_poll_usecs > FILEIO_MAX_POLL_USECS ? FILEIO_MAX_POLL_USECS : fileio_poll_usecs;
+    fileio_poll_usecs = fileio_poll_usecs < FILEIO_MIN_POLL_USECS ? FILEIO_MIN_POLL_USECS : fileio_poll_usecs;
+
+    // while jack freewheels, daemon_process waits on the i/o threads, see freewheel_wait
+    if(jc_handoff_init(&fileio_wake) || jc_handoff_init(&ring_moved)) {
+        printf("Error, could not set up the freewheel handoffs (%s)\n", strerror(errno));
+        goto done;
+    }
 
-    else if(sndmode == REC_MODE) {
-        // get pointers for all jack port buffers
-        jack_default_audio_sample_t *jackbufs[JACK_PLAY_RECORD_MAX_PORTS];
-        for(cidx=0; cidx<sndchans; cidx++) {
-            jackbufs[cidx] = jack_port_get_buffer(jackin_ports[cidx], nframes);
+    pthread_attr_init(&io_attr);
+    if(fileio_priority > 0) {
+        io_param.sched_priority = fileio_priority;
+        pthread_attr_setinheritsched(&io_attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&io_attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&io_attr, &io_param);
+    }
+    for(tidx=0; tidx<daemon_nthreads; tidx++) {
+        void *buf = pool_alloc(chunk_bytes);
+        err = pthread_create(&(io_threads[tidx]), &io_attr, daemon_io_function, buf);
+        if(err && fileio_priority > 0) {
+            err = pthread_create(&(io_threads[tidx]), NULL, daemon_io_function, buf);
         }
-        
-        // write to linbufJACK one sample at a time
-        // set outer loop over frames/samples
-        sidx = 0; // use sample index to book-keep current index in to linbufJACK
-        for(fidx=0; fidx<nframes; fidx++) {
-            // set inner loop over channels/jackbufs
-            for(cidx=0; cidx<sndchans; cidx++) {
-                // this is naive, but might be fast enough
-                linbufJACK[sidx++] = jackbufs[cidx][fidx];
-            }
+        if(err) {
+            printf("Error, could not start i/o thread %d (%s)\n", tidx, strerror(err));
+            pthread_attr_destroy(&io_attr);
+            goto done;
         }
-
-        nframes_write_available = PaUtil_GetRingBufferWriteAvailable(pa_ringbuf);
-        if( nframes_write_available < nframes) {
-            /* FIXME, report overflow problem */
+        nstarted++;
+        if(CPU_COUNT(&fileio_cpus) > 0) {
+            pthread_setaffinity_np(io_threads[tidx], sizeof(fileio_cpus), &fileio_cpus);
         }
+    }
+    pthread_attr_destroy(&io_attr);
+
+    jack_set_process_callback(client, daemon_process, 0);
+    jack_on_shutdown(client, jack_shutdown, 0);
+    jack_set_freewheel_callback(client, jack_freewheel, 0);
+    if(jack_activate(client)) {
+        fprintf(stderr, "cannot activate client");
+        goto done;
+    }
+    active = true;
 
-        nframes_written = PaUtil_WriteRingBuffer(
-            pa_ringbuf, &(linbufJACK[0]), nframes);
-        if( nframes_written != nframes) {
-            /* FIXME, report overflow */
+    while(!atomic_load_explicit(&server_shutdown, memory_order_acquire)) {
+        struct timespec poll_time = {0, 10000000};
+        c = sigtimedwait(stopmask, NULL, &poll_time);
+        if(c == SIGINT || c == SIGTERM) {
+            printf("\nINFO: caught %s, stopping\n", c == SIGINT ? "SIGINT" : "SIGTERM");
+            break;
+        }
+        if(daemon_finished()) {
+            printf("INFO: every session has finished playing, stopping\n");
+            break;
         }
-    } // end REC_MODE
-
-    else {
-        /* FIXME, catch this error */
     }
+    ret = atomic_load_explicit(&server_shutdown, memory_order_acquire) ? 1 : 0;
 
-    return 0;
-}
-
-
-
-
-/**
- * JACK calls this shutdown_callback if the server ever shuts down or
- * decides to disconnect the client.
- */
-void jack_shutdown (void *arg)
-{
-    free(ringbuf_memory);
-    arg=arg; /* silence compiler */
-    exit (1);
+done:
+    if(active && !atomic_load_explicit(&server_shutdown, memory_order_acquire)) {
+        jack_deactivate(client);
+    }
+    // the i/o threads drain the recording rings before they return
+    atomic_store_explicit(&fileio_stop, true, memory_order_release);
+    for(tidx=0; tidx<nstarted; tidx++) {
+        pthread_join(io_threads[tidx], NULL);
+    }
+    for(sidx=0; sidx<daemon_nsessions; sidx++) {
+        if(daemon_sessions[sidx].sndf != NULL) {
+            sf_close(daemon_sessions[sidx].sndf);
+        }
+    }
+    jack_client_close(client);
+    free(daemon_pool);
+    return ret;
 }
 
 void usage(void) {
@@ -264,11 +2067,105 @@ void usage(void) {
     printf("  -f,    specify the intended nframes for use with jack server\n");
     printf("         note, that this will save on memory, but is unsafe if the\n");
     printf("         jack server nframes value is ever increased\n");
+    printf("  -b,    size the ring buffer to hold this many milliseconds of audio,\n");
+    printf("         plus a measured allowance for disk latency, instead of -f\n");
     printf("  -e,    specify number of repetitions, default=0 (infinite)\n");
+    printf("  -o,    when playing, only these file channels, in this order, e.g. 3,1\n");
+    printf("         or 9-12; a channel may be listed more than once\n");
     printf("  -w,    wait until W ports have been connected before playing or recording\n");
+    printf("  -C,    connect the channels in order to the ports matching this regular\n");
+    printf("         expression, or to the physical ports with -C physical\n");
+    printf("  -m,    prefault and mlock the ring buffer and scratch buffers\n");
+    printf("  -M,    mlockall, locking all current and future memory\n");
+    printf("  -P,    run the file i/o thread SCHED_FIFO at priority P, keep this\n");
+    printf("         below the jack server's priority\n");
+    printf("  -a,    pin the file i/o thread to these cpus, e.g. 2,3 or 4-7\n");
+    printf("  -A,    keep the file i/o thread off the cpu the jack thread runs on\n");
+    printf("  -d,    daemon mode, run every session listed in this file on one\n");
+    printf("         jack client, one per line as 'play NAME FILE [REPETITIONS]'\n");
+    printf("         or 'record NAME FILE CHANNELS'; ports are NAME_out_01 etc;\n");
+    printf("         -w, -C, --start-at, --duration, --sync-interval, --timecode\n");
+    printf("         and --tap are for a single session only\n");
+    printf("  -T,    number of file i/o threads shared by the sessions with -d,\n");
+    printf("         default=2\n");
+    printf("  --start-at=T\n");
+    printf("         start at jack frame time T, T frames after being ready with +T,\n");
+    printf("         or when the rolling transport reaches frame T with @T; T may\n");
+    printf("         also be in seconds or milliseconds, e.g. +2.5s or @1500ms\n");
+    printf("  --duration=D\n");
+    printf("         stop after D frames (or e.g. 10s, 250ms), then finish the file\n");
+    printf("         and exit\n");
+    printf("  --drain-timeout=S\n");
+    printf("         when stopping, wait at most S seconds (default 10) for the\n");
+    printf("         ring buffer to drain to disk before giving up on the file\n");
+    printf("  --fast-start=MS\n");
+    printf("         when playing, preload only MS of audio before starting and\n");
+    printf("         fill the rest of the ring while running; reports the time to\n");
+    printf("         first sample\n");
+    printf("  --decode-cache=MB\n");
+    printf("         keep up to MB (default 256) of a compressed file decoded in\n");
+    printf("         memory, so repetitions with -e don't decode it again\n");
+    printf("  --decode-bench\n");
+    printf("         decode the -p file as fast as possible, report frames/s, exit\n");
+    printf("  --readahead=N\n");
+    printf("         when playing, decode N blocks of %d frames ahead in their own\n", READAHEAD_BLOCK_FRAMES);
+    printf("         thread, with the kernel fetching the file ahead of that;\n");
+    printf("         compressed files (FLAC, Ogg, Opus, MP3) default to %d\n", READAHEAD_COMPRESSED_BLOCKS);
+    printf("  --sparse-threshold=DB\n");
+    printf("         recording to a .jprs file stores each channel's blocks whose\n");
+    printf("         peak is at or below DB dBFS as silence; by default only blocks\n");
+    printf("         of exact zeros, which is lossless\n");
+    printf("  --export=OUT.wav\n");
+    printf("         with -p file.jprs, write it out as a WAV file and exit\n");
+    printf("  --profile\n");
+    printf("         time each stage of every jack cycle (port buffers, interleaving,\n");
+    printf("         the ring) and every file read or write, and report how long\n");
+    printf("         they take, and what share of the period, on SIGUSR1 and at exit\n");
+    printf("  --log=FILE\n");
+    printf("         append the messages from the jack and file i/o threads\n");
+    printf("         (underflows, overflows, i/o errors) to FILE, time stamped,\n");
+    printf("         instead of stderr; each kind is written at most once a second\n");
+    printf("  --timecode[=S]\n");
+    printf("         when recording, stamp a WAV's bext chunk with the time of its\n");
+    printf("         first frame, and note in FILE.timing the jack frame time and\n");
+    printf("         jack and wall clock times at the start, the end, and every S\n");
+    printf("         seconds (default %.0f) between; not with -r -\n", TIMECODE_DEFAULT_SECS);
+    printf("  --stream-format=F\n");
+    printf("         with -r - (stdout) or -p - (stdin), wav (default) for a WAV\n");
+    printf("         header with unknown length, or raw for bare interleaved\n");
+    printf("         32 bit floats; raw playback needs -c\n");
+    printf("  --tap=NAME\n");
+    printf("         when recording, also keep the last of the audio in the shared\n");
+    printf("         memory segment /NAME, for local tools to read in place; the\n");
+    printf("         layout is in jack_play_record_tap.h\n");
+    printf("  --tap-seconds=S\n");
+    printf("         how much audio the --tap ring holds, default 1\n");
+    printf("  --sync-interval=S\n");
+    printf("         when recording, every S seconds update the file's header and\n");
+    printf("         flush it to disk, noting how much is safe in FILE.journal, so\n");
+    printf("         a crash or power loss leaves a file valid up to that point\n");
+    printf("\n");
+    printf("  SIGINT (ctrl-c) or SIGTERM stop cleanly, keeping everything recorded\n");
     printf("\n\n");
 }
 
+/* How long it took from launch to the first frame of the file reaching
+ * jack, or being taken from it: the cycle it happened in, plus where in
+ * the cycle, plus (when playing) the latency of the ports downstream */
+void report_time_to_first_sample(void) {
+    jack_nframes_t rate = jack_get_sample_rate(client);
+    jack_latency_range_t range = {0, 0};
+    double msecs = 1e3 * (first_cycle_time.tv_sec - launch_time.tv_sec) +
+        1e-6 * (first_cycle_time.tv_nsec - launch_time.tv_nsec);
+
+    msecs += 1e3 * first_cycle_offset / rate;
+    if(sndmode == PLAY_MODE && nports > 0) {
+        jack_port_get_latency_range(jackout_ports[0], JackPlaybackLatency, &range);
+    }
+    printf("INFO: time to first sample %.1f ms after launch (%.1f ms more of playback latency)\n",
+        msecs, 1e3 * range.max / rate);
+}
+
 void fyi(void) {
     char *play_record = sndmode==PLAY_MODE ? "play from" : "record to";
     printf("\nINFO: Attempting to\n    %s %s, where\n    channels=%d, and \n    client-name='%s'\n\n",
@@ -278,17 +2175,56 @@ void fyi(void) {
 int main (int argc, char *argv[])
 {
     // const char **ports;
-    pthread_t fileio_thread;
+    pthread_t fileio_thread, sync_thread, readahead_thread;
+    pthread_attr_t fileio_attr;
+    struct sched_param fileio_param;
     int thr = 1;
-    const char *server_name = NULL;
-    jack_options_t options = JackNullOption;
-    jack_status_t status;
-
-    int cidx, c, err;
-
-    char portname[JACK_PORT_NAME_SIZE] = {0};
 
-    while ((c = getopt (argc, argv, "p:r:c:n:f:w:e:h")) != -1)
+    int cidx, c, err, exit_status = 0;
+    FILE *log_fp = NULL;
+    bool reported_start = false;
+    sigset_t stopmask;
+    struct timespec poll_time = {0, 10000000}, drain_deadline;
+    int preload_nframes;
+    enum long_only_options{
+        OPT_START_AT = 256,
+        OPT_DURATION,
+        OPT_DRAIN_TIMEOUT,
+        OPT_SYNC_INTERVAL,
+        OPT_READAHEAD,
+        OPT_FAST_START,
+        OPT_DECODE_CACHE,
+        OPT_DECODE_BENCH,
+        OPT_TAP,
+        OPT_TAP_SECONDS,
+        OPT_STREAM_FORMAT,
+        OPT_SPARSE_THRESHOLD,
+        OPT_EXPORT,
+        OPT_TIMECODE,
+        OPT_LOG,
+        OPT_PROFILE };
+    static struct option long_options[] = {
+        {"start-at", required_argument, 0, OPT_START_AT},
+        {"duration", required_argument, 0, OPT_DURATION},
+        {"drain-timeout", required_argument, 0, OPT_DRAIN_TIMEOUT},
+        {"sync-interval", required_argument, 0, OPT_SYNC_INTERVAL},
+        {"readahead", required_argument, 0, OPT_READAHEAD},
+        {"fast-start", required_argument, 0, OPT_FAST_START},
+        {"decode-cache", required_argument, 0, OPT_DECODE_CACHE},
+        {"decode-bench", no_argument, 0, OPT_DECODE_BENCH},
+        {"tap", required_argument, 0, OPT_TAP},
+        {"tap-seconds", required_argument, 0, OPT_TAP_SECONDS},
+        {"stream-format", required_argument, 0, OPT_STREAM_FORMAT},
+        {"sparse-threshold", required_argument, 0, OPT_SPARSE_THRESHOLD},
+        {"export", required_argument, 0, OPT_EXPORT},
+        {"timecode", optional_argument, 0, OPT_TIMECODE},
+        {"log", required_argument, 0, OPT_LOG},
+        {"profile", no_argument, 0, OPT_PROFILE},
+        {0, 0, 0, 0} };
+
+    clock_gettime(CLOCK_MONOTONIC, &launch_time);
+
+    while ((c = getopt_long (argc, argv, "p:r:c:n:f:b:w:e:o:C:mMP:a:Ad:T:h", long_options, NULL)) != -1)
     switch (c)
         {
         case 'p':
@@ -308,12 +2244,104 @@ int main (int argc, char *argv[])
         case 'f':
             ringbuf_nframes = atoi(optarg);
             break;
+        case 'b':
+            buffer_msecs = atof(optarg);
+            break;
         case 'w':
             waitchans = atoi(optarg);
             break;
+        case 'o':
+            snprintf(channel_map_spec, CHANNEL_MAP_SIZE, "%s", optarg);
+            break;
+        case 'C':
+            snprintf(connect_pattern, CONNECT_PATTERN_SIZE, "%s", optarg);
+            break;
         case 'e':
             repetitions = atoi(optarg);
             break;
+        case 'm':
+            lock_memory = LOCK_MEMORY_BUFFERS;
+            break;
+        case 'M':
+            lock_memory = LOCK_MEMORY_ALL;
+            break;
+        case 'P':
+            fileio_priority = atoi(optarg);
+            break;
+        case 'a':
+            if(parse_cpu_list(optarg, &fileio_cpus)) {
+                printf("Error, could not parse cpu list '%s'\n", optarg);
+                usage();
+                return 1;
+            }
+            break;
+        case 'A':
+            avoid_jack_cpu = 1;
+            break;
+        case 'd':
+            snprintf(daemon_fname, SND_FNAME_SIZE, "%s", optarg);
+            break;
+        case 'T':
+            daemon_nthreads = atoi(optarg);
+            break;
+        case OPT_START_AT:
+            snprintf(start_at_spec, TIME_SPEC_SIZE, "%s", optarg);
+            break;
+        case OPT_DURATION:
+            snprintf(duration_spec, TIME_SPEC_SIZE, "%s", optarg);
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            drain_timeout_secs = atof(optarg);
+            break;
+        case OPT_SYNC_INTERVAL:
+            sync_interval_secs = atof(optarg);
+            break;
+        case OPT_READAHEAD:
+            readahead_nblocks = atoi(optarg);
+            break;
+        case OPT_FAST_START:
+            fast_start_msecs = atof(optarg);
+            break;
+        case OPT_DECODE_CACHE:
+            decode_cache_mbytes = atof(optarg);
+            break;
+        case OPT_DECODE_BENCH:
+            decode_bench = true;
+            break;
+        case OPT_TAP:
+            snprintf(tap_name, TAP_NAME_SIZE, "%s", optarg);
+            break;
+        case OPT_TAP_SECONDS:
+            tap_secs = atof(optarg);
+            break;
+        case OPT_SPARSE_THRESHOLD:
+            sparse_threshold_db = atof(optarg);
+            break;
+        case OPT_EXPORT:
+            snprintf(export_fname, SND_FNAME_SIZE, "%s", optarg);
+            break;
+        case OPT_TIMECODE:
+            timecode_secs = optarg ? atof(optarg) : TIMECODE_DEFAULT_SECS;
+            break;
+        case OPT_LOG:
+            snprintf(log_fname, SND_FNAME_SIZE, "%s", optarg);
+            break;
+        case OPT_PROFILE:
+            profiling = true;
+            break;
+        case OPT_STREAM_FORMAT:
+            if(0 == strcmp(optarg, "wav")) {
+                stream_format = STREAM_WAV;
+            }
+            else if(0 == strcmp(optarg, "raw")) {
+                stream_format = STREAM_RAW;
+            }
+            else {
+                printf("Error, --stream-format is wav or raw, not '%s'\n", optarg);
+                usage();
+                return 1;
+            }
+            break;
         case 'h':
             usage();
             return 0;
@@ -321,12 +2349,72 @@ int main (int argc, char *argv[])
             abort ();
     }
 
+    /* the single session extras have no meaning for -d's sessions */
+    if(daemon_fname[0] != 0 &&
+       (waitchans != 0 || connect_pattern[0] != 0 || start_at_spec[0] != 0 || duration_spec[0] != 0 ||
+        sync_interval_secs > 0.0 || timecode_secs > 0.0 || tap_name[0] != 0)) {
+        printf("Error, -w, -C, --start-at, --duration, --sync-interval, --timecode and --tap can't be used with -d\n");
+        return 1;
+    }
+
+    /* what the threads have to say goes through the log's queue from here on */
+    if(log_fname[0] != 0 && (log_fp = fopen(log_fname, "a")) == NULL) {
+        printf("Error, could not open %s (%s)\n", log_fname, strerror(errno));
+        return 1;
+    }
+    if(jc_log_open(log_fp)) {
+        printf("Error, could not start the log thread\n");
+        return 1;
+    }
+
+    /* -d hosts its sessions itself */
+    if(daemon_fname[0] != 0) {
+        if(jackname[0] == 0) {
+            snprintf(jackname, JACK_CLIENT_NAME_SIZE, "jack_play_record_daemon");
+        }
+        sigemptyset(&stopmask);
+        sigaddset(&stopmask, SIGINT);
+        sigaddset(&stopmask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopmask, NULL);
+        exit_status = run_daemon(&stopmask);
+        jc_log_close();
+        return exit_status;
+    }
+
     /* after parsing args, if sndfname is empty, then just print usage */
     if(0 == strlen((const char *)sndfname)) {
         usage();
         return 0;
     }
 
+    /* -r - keeps stdout for the audio, everything we'd print goes to stderr */
+    if(sndmode == REC_MODE && 0 == strcmp(sndfname, "-")) {
+        stream_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        signal(SIGPIPE, SIG_IGN); // a closed pipe shows up as EPIPE instead
+        fcntl(stream_fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    }
+
+    /* nor does --export */
+    if(export_fname[0] != 0) {
+        if(sndmode != PLAY_MODE || !jpr_sparse_is_sparse(sndfname)) {
+            printf("Error, --export needs -p and a sparse (.jprs) file\n");
+            return 1;
+        }
+        if(jpr_sparse_export_wav(sndfname, export_fname)) {
+            printf("Error, could not export %s to %s\n", sndfname, export_fname);
+            return 1;
+        }
+        printf("INFO: exported %s to %s\n", sndfname, export_fname);
+        return 0;
+    }
+
+    /* --decode-bench doesn't need jack at all */
+    if(decode_bench) {
+        return run_decode_bench();
+    }
+
     /* ensure there's a reasonable jack client name if not already set */
     if( jackname[0] == 0 ) {
         snprintf(jackname, JACK_CLIENT_NAME_SIZE, "%s", \
@@ -336,38 +2424,85 @@ int main (int argc, char *argv[])
     /* let user know what settings have been parsed */
     fyi();
 
-    /* force 0 <= waitchans <= sndchans */
-    waitchans = waitchans <        0 ?        0 : waitchans;
-    waitchans = waitchans > sndchans ? sndchans : waitchans;
-    if(waitchans >  0) {
-        keep_waiting = 1;
+    /* block SIGINT and SIGTERM before any threads start, so they all inherit
+        the mask and main picks the signals up with sigtimedwait() below */
+    sigemptyset(&stopmask);
+    sigaddset(&stopmask, SIGINT);
+    sigaddset(&stopmask, SIGTERM);
+    if(profiling) {
+        sigaddset(&stopmask, SIGUSR1); // not to stop, but for a report
     }
+    pthread_sigmask(SIG_BLOCK, &stopmask, NULL);
 
 	/* open a client connection to the JACK server */
-	client = jack_client_open(jackname, options, &status, server_name);
+	client = jc_client_open(jackname, JACK_CLIENT_NAME_SIZE);
 	if (client == NULL) {
-		fprintf (stderr, "jack_client_open() failed, "
-			 "status = 0x%2.0x\n", status);
-		if (status & JackServerFailed) {
-			fprintf (stderr, "Unable to connect to JACK server\n");
-		}
 		exit (1);
 	}
-	if (status & JackServerStarted) {
-		fprintf (stderr, "JACK server started\n");
-	}
-	if (status & JackNameNotUnique) {
-		snprintf(jackname, JACK_CLIENT_NAME_SIZE, "%s", jack_get_client_name(client));
-		fprintf(stderr, "unique name `%s' assigned\n", &(jackname[0]));
-	}
 
 
 
     /* with an unconfigured jack client, we can do some sndfile prep, like get the sample rate*/
-    if( sndmode == PLAY_MODE ){
+    if(sndmode == PLAY_MODE && jpr_sparse_is_sparse(sndfname)) {
+        sparse_in = jpr_sparse_open(sndfname);
+        if(sparse_in == NULL) {
+            printf("Error, could not read the sparse file %s\n", sndfname);
+            exit(1);
+        }
+        sndchans = sndfinfo.channels = sparse_in->header.nchans;
+        sndfinfo.samplerate = sparse_in->header.samplerate;
+        sndfinfo.frames = sparse_in->header.nframes;
+        sndfinfo.format = SF_FORMAT_RAW | SF_FORMAT_FLOAT; // i.e. nothing to decode
+        sndfinfo.seekable = 1;
+    }
+    else if( sndmode == PLAY_MODE ){
         sndfinfo.format = 0;
-        sndf = sf_open((const char *)sndfname, sndmode, &sndfinfo);
+        if(0 == strcmp(sndfname, "-")) {
+            // -p -, libsndfile reads WAV (and other streamable formats) from a
+            // pipe itself, raw floats need to be described up front
+            sndfd = dup(STDIN_FILENO);
+            fcntl(sndfd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+            if(stream_format == STREAM_RAW) {
+                if(sndchans <= 0) {
+                    printf("Error, -p - with --stream-format=raw needs -c\n");
+                    exit(1);
+                }
+                sndfinfo.format = SF_FORMAT_RAW | SF_FORMAT_FLOAT;
+                sndfinfo.channels = sndchans;
+                sndfinfo.samplerate = jack_get_sample_rate(client);
+            }
+            if(repetitions != 1) {
+                printf("INFO: stdin can't be rewound, playing it once\n");
+                repetitions = 1;
+            }
+        }
+        else {
+            // open the descriptor ourselves, to tell the kernel how it'll be read
+            sndfd = open((const char *)sndfname, O_RDONLY);
+        }
+        if(sndfd < 0) {
+            printf("Error, could not open %s for reading (%s)\n", sndfname, strerror(errno));
+            exit(1);
+        }
+        posix_fadvise(sndfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        sndf = sf_open_fd(sndfd, sndmode, &sndfinfo, SF_FALSE);
         sndchans = sndfinfo.channels;
+
+        // keep decoding off fileio_thread for compressed files, and with
+        // repetitions, only decode them once
+        if(sndf != NULL && is_compressed(sndfinfo.format)) {
+            if(readahead_nblocks == 0) {
+                readahead_nblocks = READAHEAD_COMPRESSED_BLOCKS;
+            }
+            if(repetitions != 1 && sndfinfo.frames > 0 &&
+               sizeof(jack_default_audio_sample_t) * sndchans * (double)sndfinfo.frames
+                    <= decode_cache_mbytes * 1024.0 * 1024.0) {
+                decode_cache_capacity = sndfinfo.frames;
+                decode_cache = malloc(sizeof(jack_default_audio_sample_t) * sndchans * decode_cache_capacity);
+            }
+            printf("INFO: compressed file, decoding %d blocks ahead%s\n", readahead_nblocks,
+                decode_cache ? ", and caching the decoded audio for repetitions" : "");
+        }
     }
     else if(sndmode == REC_MODE ){
         /* if recording, error out if channels is not specified */
@@ -379,15 +2514,73 @@ int main (int argc, char *argv[])
         sndfinfo.samplerate = jack_get_sample_rate(client);
         sndfinfo.channels = sndchans;
         sndfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
-        sndf = sf_open((const char *)sndfname, sndmode, &sndfinfo);
+    }
+    if(sndmode == REC_MODE && stream_fd >= 0) {
+        // -r -, fileio_thread writes the stream itself
+        if(write_stream_header(jack_get_sample_rate(client))) {
+            printf("Error, could not write to stdout (%s)\n", strerror(errno));
+            exit(1);
+        }
+        if(sync_interval_secs > 0.0) {
+            printf("INFO: --sync-interval does nothing when streaming to stdout\n");
+            sync_interval_secs = 0.0;
+        }
+    }
+    else if(sndmode == REC_MODE && is_sparse_name(sndfname)) {
+        sparse_out = jpr_sparse_create(sndfname, sndchans, sndfinfo.samplerate,
+            (float)pow(10.0, sparse_threshold_db / 20.0));
+        if(sparse_out == NULL) {
+            printf("Error, could not create the sparse file %s (at most %d channels)\n",
+                sndfname, JPR_SPARSE_MAX_CHANS);
+            exit(1);
+        }
+        if(sync_interval_secs > 0.0) {
+            printf("INFO: --sync-interval does nothing for sparse files\n");
+            sync_interval_secs = 0.0;
+        }
+    }
+    else if(sndmode == REC_MODE) {
+        // open the descriptor ourselves, so there's something to fdatasync
+        sndfd = open((const char *)sndfname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(sndfd < 0) {
+            printf("Error, could not open %s for writing (%s)\n", sndfname, strerror(errno));
+            exit(1);
+        }
+        sndf = sf_open_fd(sndfd, sndmode, &sndfinfo, SF_FALSE);
+        if(timecode_secs > 0.0 && sndf != NULL) {
+            // make room for bext now, it's filled in once recording starts
+            set_bext(0);
+            if(!has_bext) {
+                printf("WRN: %s's format has no bext chunk, the time is only in the .timing file\n", sndfname);
+            }
+            sf_command(sndf, SFC_UPDATE_HEADER_NOW, NULL, 0);
+        }
+        // libsndfile has written the initial header, the data starts here
+        data_offset = lseek(sndfd, 0, SEEK_CUR);
     }
 
-    int sferr = sf_error(sndf);
+    int sferr = (stream_fd >= 0 || sparse_in || sparse_out) ? 0 : sf_error(sndf);
     if(sferr) {
         printf("Tried to open %s and obtained this error code from sf_error: %d\n",
                 sndfname, sferr);
     }
 
+    /* now that the sample rate is known, work out --start-at and --duration */
+    if(start_at_spec[0] != 0 &&
+       parse_time_spec(start_at_spec, jack_get_sample_rate(client), true, &start_mode, &start_value)) {
+        printf("Error, could not parse --start-at=%s\n", start_at_spec);
+        exit(1);
+    }
+    if(duration_spec[0] != 0) {
+        int unused_mode;
+        int64_t nframes;
+        if(parse_time_spec(duration_spec, jack_get_sample_rate(client), false, &unused_mode, &nframes)) {
+            printf("Error, could not parse --duration=%s\n", duration_spec);
+            exit(1);
+        }
+        duration_nframes = (uint64_t)nframes;
+    }
+
     /* tell the JACK server to call `process()' whenever
         there is work to be done.
     */
@@ -400,66 +2593,194 @@ int main (int argc, char *argv[])
 
     jack_on_shutdown (client, jack_shutdown, 0);
 
+    /* and `jack_freewheel()' when the graph stops or starts running faster
+        than realtime
+    */
+    if(jc_handoff_init(&fileio_wake) || jc_handoff_init(&ring_moved)) {
+        printf("Error, could not set up the freewheel handoffs (%s)\n", strerror(errno));
+        exit(1);
+    }
+    jack_set_freewheel_callback(client, jack_freewheel, 0);
+
+    /* keep count of connected ports for -w, outside of the process thread */
+    jack_set_port_connect_callback(client, jack_port_connect, 0);
+
     /* FIXME, throw error if file sample rate and jack sample rate are different */
 
-    /* create jack ports */
-    for(cidx=0; cidx<sndchans; cidx++) {
-        if(sndmode == PLAY_MODE){
-            snprintf(portname, JACK_PORT_NAME_SIZE, "out_%02d", cidx+1);
-            jackout_ports[cidx] = jack_port_register(client, portname,                    
-                    JACK_DEFAULT_AUDIO_TYPE,
-                    JackPortIsOutput, 0);
-            /* printf("jackout_ports[%d] = %p\n", cidx, jackout_ports[cidx]); */
-        }
-        else if(sndmode == REC_MODE) {
-            snprintf(portname, JACK_PORT_NAME_SIZE, "in_%02d", cidx+1);
-            jackin_ports[cidx] = jack_port_register (client, portname,
-                    JACK_DEFAULT_AUDIO_TYPE,
-                    JackPortIsInput, 0);
-            /* printf("jackin_ports[%d] = %p\n", cidx, jackin_ports[cidx]); */
+    /* with -o only the channels it lists get ports, otherwise all of them */
+    nports = sndchans;
+    for(cidx=0; cidx<sndchans && cidx<JACK_PLAY_RECORD_MAX_PORTS; cidx++) {
+        channel_map[cidx] = cidx;
+    }
+    if(sndmode == PLAY_MODE && channel_map_spec[0] != 0) {
+        nports = parse_channel_map(channel_map_spec, sndchans);
+        if(nports == 0) {
+            printf("Error, -o %s isn't a list of at most %d of the file's channels 1-%d\n",
+                channel_map_spec, JACK_PLAY_RECORD_MAX_PORTS, sndchans);
+            exit(1);
         }
-        // else {} , FIXME
+    }
+    if(nports > JACK_PLAY_RECORD_MAX_PORTS) {
+        printf("Error, at most %d ports, not %d\n", JACK_PLAY_RECORD_MAX_PORTS, nports);
+        exit(1);
     }
 
+    /* force 0 <= waitchans <= nports, now that it's known for playback too */
+    waitchans = waitchans <      0 ?      0 : waitchans;
+    waitchans = waitchans > nports ? nports : waitchans;
+    if(waitchans >  0) {
+        keep_waiting = 1;
+    }
 
-    /* Let's set up a pa_ringbuffer, for single producer, single consumer */
-    /* ensure ringbuf_nframes is a power of 2 */
-    ringbuf_nframes = nextpow2(ringbuf_nframes);
+    /* create jack ports */
+    if(sndmode == PLAY_MODE ?
+            jc_register_ports(client, jackout_ports, nports, "out", JackPortIsOutput) :
+            jc_register_ports(client, jackin_ports, nports, "in", JackPortIsInput)) {
+        exit(1);
+    }
 
-    /* malloc space for pa_ringbuffer */
-    ringbuf_memory = malloc( 
-        sizeof(jack_default_audio_sample_t) * sndchans * 4 * ringbuf_nframes);
 
-    // ring_buffer_size_t PaUtil_InitializeRingBuffer ( PaUtilRingBuffer * rbuf,
-    //     ring_buffer_size_t elementSizeBytes,
-    //     ring_buffer_size_t elementCount,
-    //     void * dataPtr )
-    err = PaUtil_InitializeRingBuffer(pa_ringbuf, 
-        sizeof(jack_default_audio_sample_t) * sndchans,
-        4 * ringbuf_nframes,
-        ringbuf_memory);
-    if(err) {
-        printf("encountered error code (%d) trying to call PaUtil_InitializeRingBuffer\n",err);
+    /* the scratch buffers, one chunk of sndchans channels each */
+    linbufFILE = malloc(sizeof(jack_default_audio_sample_t) * sndchans * JACK_PLAY_RECORD_MAX_FRAMES);
+    linbufJACK = malloc(sizeof(jack_default_audio_sample_t) * sndchans * JACK_PLAY_RECORD_MAX_FRAMES);
+    if(linbufFILE == NULL || linbufJACK == NULL) {
+        printf("Error, could not allocate scratch buffers for %d channels\n", sndchans);
+        exit(1);
     }
 
-    // if we're playing a file, let's pre-load the ring buffer with some data
+    /* Let's set up a pa_ringbuffer, for single producer, single consumer,
+        sized from -b and how long the file takes to read, or from -f */
+    ring_capacity = ring_frames_for(jack_get_sample_rate(client), jack_get_buffer_size(client),
+        (buffer_msecs > 0.0 && sndmode == PLAY_MODE && sndfinfo.seekable) ? probe_read_latency() : 0.0);
+    printf("INFO: ring buffer of %d frames (%.1f ms), %.1f KiB, plus %.1f KiB of scratch buffers\n",
+        ring_capacity, 1e3 * ring_capacity / jack_get_sample_rate(client),
+        sizeof(jack_default_audio_sample_t) * sndchans * (double)ring_capacity / 1024.0,
+        2.0 * sizeof(jack_default_audio_sample_t) * sndchans * JACK_PLAY_RECORD_MAX_FRAMES / 1024.0);
+
+    /* space for pa_ringbuffer, ring_capacity is already a power of 2 */
+    ringbuf_memory = jc_ring_alloc(pa_ringbuf, sizeof(jack_default_audio_sample_t) * sndchans, ring_capacity);
+    if(ringbuf_memory == NULL) {
+        printf("Error, could not allocate the ring buffer\n");
+        exit(1);
+    }
+
+    /* fault in (and maybe lock) the big buffers now, not in the jack thread */
+    if(lock_memory == LOCK_MEMORY_ALL && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        printf("WRN: could not mlockall (%s), check ulimit -l\n", strerror(errno));
+    }
+    if(lock_memory != LOCK_MEMORY_NONE) {
+        prefault_and_lock(ringbuf_memory,
+            sizeof(jack_default_audio_sample_t) * sndchans * ring_capacity, "ring buffer");
+        prefault_and_lock(linbufFILE,
+            sizeof(jack_default_audio_sample_t) * sndchans * JACK_PLAY_RECORD_MAX_FRAMES, "linbufFILE");
+        prefault_and_lock(linbufJACK,
+            sizeof(jack_default_audio_sample_t) * sndchans * JACK_PLAY_RECORD_MAX_FRAMES, "linbufJACK");
+    }
+
+    // if we're playing a file, let's pre-load the ring buffer with some data,
+    // all of it, or with --fast-start just enough to get going while
+    // fileio_thread backfills the rest
+    preload_nframes = ring_capacity;
+    if(fast_start_msecs > 0.0) {
+        preload_nframes = (int)(fast_start_msecs * jack_get_sample_rate(client) / 1e3);
+        preload_nframes = preload_nframes < 2 * (int)jack_get_buffer_size(client) ?
+            2 * (int)jack_get_buffer_size(client) : preload_nframes;
+        preload_nframes = preload_nframes > ring_capacity ? ring_capacity : preload_nframes;
+    }
     if(sndmode == PLAY_MODE){
-        int nframes_write_available = PaUtil_GetRingBufferWriteAvailable(pa_ringbuf);
-        int nframes_read = sf_readf_float(sndf, &(linbufJACK[0]), nframes_write_available);
-        int nframes_written = PaUtil_WriteRingBuffer(pa_ringbuf, &(linbufJACK[0]), nframes_read);
+        int nframes_write_available, nframes_read, nframes_written;
+        do {
+            nframes_write_available = preload_nframes - PaUtil_GetRingBufferReadAvailable(pa_ringbuf);
+            if(nframes_write_available > JACK_PLAY_RECORD_MAX_FRAMES) {
+                nframes_write_available = JACK_PLAY_RECORD_MAX_FRAMES;
+            }
+            nframes_read = file_readf(&(linbufJACK[0]), nframes_write_available);
+            cache_decoded(linbufJACK, nframes_read);
+            nframes_written = PaUtil_WriteRingBuffer(pa_ringbuf, &(linbufJACK[0]), nframes_read);
+
+            if(nframes_write_available != nframes_read) {
+                printf("WRN: in pre-loading pa_ringbuf, nframes_write_available = %d, nframes_read = %d\n",
+                    nframes_write_available, nframes_read);
+            }
+            if(nframes_read != nframes_written) {
+                printf("WRN: in pre-loading pa_ringbuf, nframes_read = %d, nframes_written = %d\n",
+                    nframes_read, nframes_written);
+            }
+        } while(nframes_read == nframes_write_available && nframes_read > 0 &&
+                PaUtil_GetRingBufferReadAvailable(pa_ringbuf) < preload_nframes);
+    }
+
+    // with --timecode, the sidecar that says when each part was recorded
+    if(sndmode == REC_MODE && timecode_secs > 0.0 && stream_fd < 0) {
+        snprintf(timingfname, TIMING_FNAME_SIZE, "%s.timing", sndfname);
+        timing_fp = fopen(timingfname, "w");
+        if(timing_fp == NULL) {
+            printf("Error, could not open %s (%s)\n", timingfname, strerror(errno));
+            exit(1);
+        }
+        PaUtil_InitializeRingBuffer(&timing_anchor_ring, sizeof(timing_anchor_t),
+                                    TIMING_ANCHORS, timing_anchor_memory);
+    }
+
+    // with --tap, set up the shared memory mirror before fileio_thread starts
+    if(sndmode == REC_MODE && tap_name[0] != 0 && open_tap(jack_get_sample_rate(client))) {
+        exit(1);
+    }
+
+    // with --readahead, hand sndf over to readahead_thread from here on
+    if(sndmode == PLAY_MODE && readahead_nblocks > 0) {
+        if(init_readahead()) {
+            printf("Error, could not allocate %d readahead blocks\n", readahead_nblocks);
+            exit(1);
+        }
+        err = pthread_create(&readahead_thread, NULL, *readahead_function, NULL);
+        if(err) {
+            printf("Error, could not start the readahead thread (%s)\n", strerror(err));
+            exit(1);
+        }
+    }
 
-        if(nframes_write_available != nframes_read) {
-            printf("WRN: in pre-loading pa_ringbuf, nframes_write_available = %d, nframes_read = %d\n",
-                nframes_write_available, nframes_read);
+    // with --sync-interval, start the journal and the thread that keeps it
+    if(sndmode == REC_MODE && sync_interval_secs > 0.0) {
+        snprintf(journalfname, JOURNAL_FNAME_SIZE, "%s.journal", sndfname);
+        journalfd = open(journalfname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(journalfd < 0) {
+            printf("Error, could not open the journal %s (%s)\n", journalfname, strerror(errno));
+            exit(1);
         }
-        if(nframes_read != nframes_written) {
-            printf("WRN: in pre-loading pa_ringbuf, nframes_read = %d, nframes_read = %d\n",
-                nframes_read, nframes_read);
+        write_journal(0);
+        sem_init(&sync_sem, 0, 0);
+        err = pthread_create(&sync_thread, NULL, *sync_function, NULL);
+        if(err) {
+            printf("Error, could not start the sync thread (%s)\n", strerror(err));
+            exit(1);
         }
     }
 
-    // start the fileio_thread
-    pthread_create(&fileio_thread, NULL, *fileio_function, (void *) &(thr));
+    // start the fileio_thread, realtime if asked to
+    pthread_attr_init(&fileio_attr);
+    if(fileio_priority > 0) {
+        if(fileio_priority >= jack_client_real_time_priority(client) &&
+           jack_client_real_time_priority(client) > 0) {
+            printf("WRN: -P %d is not below the jack thread's priority of %d\n",
+                fileio_priority, jack_client_real_time_priority(client));
+        }
+        fileio_param.sched_priority = fileio_priority;
+        pthread_attr_setinheritsched(&fileio_attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&fileio_attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&fileio_attr, &fileio_param);
+    }
+    err = pthread_create(&fileio_thread, &fileio_attr, *fileio_function, (void *) &(thr));
+    if(err && fileio_priority > 0) {
+        printf("WRN: could not start the file i/o thread SCHED_FIFO (%s), using the default policy\n",
+            strerror(err));
+        err = pthread_create(&fileio_thread, NULL, *fileio_function, (void *) &(thr));
+    }
+    pthread_attr_destroy(&fileio_attr);
+    if(err) {
+        printf("Error, could not start the file i/o thread (%s)\n", strerror(err));
+        exit(1);
+    }
 
     /* Tell the JACK server that we are ready to roll.  Our
     * process() callback will start running now. */
@@ -476,43 +2797,107 @@ int main (int argc, char *argv[])
     * "input" to the backend, and capture ports are "output" from
     * it.
     */
+    if(connect_pattern[0] != 0) {
+        auto_connect();
+    }
 
-    /* FIXME add command line arg to auto-connect to a block... */
-    // ports = jack_get_ports (client, NULL, NULL,
-    // 			JackPortIsPhysical|JackPortIsOutput);
-    // if (ports == NULL) {
-    // 	fprintf(stderr, "no physical capture ports\n");
-    // 	exit (1);
-    // }
-
-    // if (jack_connect (client, ports[0], jack_port_name (input_port))) {
-    // 	fprintf (stderr, "cannot connect input ports\n");
-    // }
-
-    // free (ports);
-
-    // ports = jack_get_ports (client, NULL, NULL,
-    // 			JackPortIsPhysical|JackPortIsInput);
-    // if (ports == NULL) {
-    // 	fprintf(stderr, "no physical playback ports\n");
-    // 	exit (1);
-    // }
-
-    // if (jack_connect (client, jack_port_name (output_port), ports[0])) {
-    // 	fprintf (stderr, "cannot connect output ports\n");
-    // }
-
-    // free (ports);
-
-    /* keep running until stopped by the user */
-
-    sleep (-1);
+    /* keep running until stopped by the user, the jack server goes away,
+        or --duration is up */
+    while(!atomic_load_explicit(&run_finished, memory_order_acquire)) {
+        if(!reported_start && atomic_load_explicit(&run_started, memory_order_acquire)) {
+            printf("INFO: started at jack frame time %u\n", run_start_frame);
+            report_time_to_first_sample();
+            reported_start = true;
+        }
+        if(atomic_load_explicit(&server_shutdown, memory_order_acquire)) {
+            printf("WRN: the jack server shut down or dropped this client\n");
+            exit_status = 1;
+            break;
+        }
+        if(atomic_load_explicit(&stream_closed, memory_order_acquire)) {
+            exit_status = 1;
+            break;
+        }
+        c = sigtimedwait(&stopmask, NULL, &poll_time);
+        if(c == SIGUSR1) {
+            profile_report();
+        }
+        if(c == SIGINT || c == SIGTERM) {
+            printf("\nINFO: caught %s, stopping\n", c == SIGINT ? "SIGINT" : "SIGTERM");
+            break;
+        }
+    }
 
-    /* this is never reached but if the program
-        had some other way to exit besides being killed,
-        they would be important to call.
-    */
+    /* stop the jack thread, let fileio_thread write out what's left in the
+        ring, and finish the file so its header is right */
+    if(!atomic_load_explicit(&server_shutdown, memory_order_acquire)) {
+        jack_deactivate(client);
+    }
+    atomic_store_explicit(&fileio_stop, true, memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &drain_deadline);
+    drain_deadline.tv_sec += (time_t)drain_timeout_secs;
+    drain_deadline.tv_nsec += (long)((drain_timeout_secs - (time_t)drain_timeout_secs) * 1e9);
+    if(drain_deadline.tv_nsec >= 1000000000L) {
+        drain_deadline.tv_sec += 1;
+        drain_deadline.tv_nsec -= 1000000000L;
+    }
+    if(pthread_timedjoin_np(fileio_thread, NULL, &drain_deadline)) {
+        // fileio_thread is stuck in the file, closing it under it isn't safe
+        printf("Error, the ring buffer did not drain within %.1f s, %s may be incomplete\n",
+            drain_timeout_secs, sndfname);
+        exit(1);
+    }
+    if(sndmode == PLAY_MODE && readahead_nblocks > 0) {
+        pthread_join(readahead_thread, NULL);
+    }
+    if(journalfd >= 0) {
+        atomic_store_explicit(&sync_stop, true, memory_order_release);
+        sem_post(&sync_sem);
+        pthread_join(sync_thread, NULL);
+    }
+    if(tap != NULL) {
+        close_tap();
+    }
+    if(timing_fp != NULL) {
+        fclose(timing_fp);
+    }
+    if(sndf != NULL) {
+        sf_close(sndf);
+    }
+    if(sparse_out != NULL && jpr_sparse_close(sparse_out)) {
+        printf("Error, could not finish %s\n", sndfname);
+        exit_status = 1;
+    }
+    if(sparse_in != NULL) {
+        jpr_sparse_close(sparse_in);
+    }
+    if(stream_fd >= 0) {
+        close(stream_fd);
+    }
+    if(journalfd >= 0 && fdatasync(sndfd) == 0) {
+        // the final header is on disk too, the journal has done its job
+        close(journalfd);
+        unlink(journalfname);
+    }
+    if(sndfd >= 0) {
+        close(sndfd);
+    }
+    jc_log_close();
+    printf("INFO: finished after %" PRIu64 " frames\n", run_nframes_done);
+    printf("INFO: disk latency p50 %.2f ms, p99 %.2f ms, max %.2f ms; ring headroom fell to %.0f%%\n",
+        disk_latency_percentile(50.0), disk_latency_percentile(99.0),
+        disk_latency_max_usecs / 1e3, 100.0 * min_ring_headroom);
+    if(profiling) {
+        profile_report();
+    }
+    if(buffer_msecs > 0.0 && disk_latency_percentile(99.0) > buffer_msecs) {
+        printf("WRN: p99 disk latency is over -b %.0f, consider a larger -b\n", buffer_msecs);
+    }
 
     jack_client_close (client);
-    exit (0);
+    free(ringbuf_memory);
+    free(linbufFILE);
+    free(linbufJACK);
+    free(decode_cache);
+    exit (exit_status);
 }
@@ -0,0 +1,71 @@
+/** @file jack_play_record_tap.h
+ *
+ * @brief Layout of the shared memory segment that jack_play_record mirrors
+ * what it records in to when started with --tap=name.
+ *
+ * Local tools shm_open() the same name read-write, mmap() header_size bytes
+ * to read the header, then mmap() header_size + the ring's size to get at
+ * the frames, which they read in place.  The ring holds the last capacity
+ * frames, interleaved 32 bit floats, with frame f at
+ *
+ *     (float *)((char *)tap + tap->data_offset) + (f % tap->capacity) * tap->nchans
+ *
+ * The writer never waits for readers.  It first advances claim_frame to
+ * where this write will end, then copies frames in, then advances
+ * write_frame to match, so frames below claim_frame - capacity may be torn
+ * or gone.  A reader that has fallen more than capacity frames behind has
+ * lost data, and one whose copy raced the writer round the ring has to
+ * throw that copy away, seqlock style:
+ *
+ *     end = __atomic_load_n(&(tap->write_frame), __ATOMIC_ACQUIRE);
+ *     if(end - pos > tap->capacity) {
+ *         pos = end - tap->capacity; // overrun, skip ahead
+ *     }
+ *     ... copy or analyse frames [pos, end) in place ...
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     if(__atomic_load_n(&(tap->claim_frame), __ATOMIC_RELAXED) - pos > tap->capacity) {
+ *         ... the oldest of those frames were being overwritten meanwhile ...
+ *     }
+ *     pos = end;
+ *
+ * A reader can claim one of the readers[] slots, by compare-and-swapping its
+ * pid in to an empty one, and keep its read_frame there so the writer (and
+ * anything else watching) can see how far behind each reader is.  Slots are
+ * optional, and only advisory.
+ */
+
+#ifndef JACK_PLAY_RECORD_TAP_H
+#define JACK_PLAY_RECORD_TAP_H
+
+#include <stdint.h>
+
+#define JACK_PLAY_RECORD_TAP_MAGIC (0x5452504a) // "JPRT", little endian
+#define JACK_PLAY_RECORD_TAP_VERSION (2)
+#define JACK_PLAY_RECORD_TAP_MAX_READERS (16)
+
+// flags
+#define JACK_PLAY_RECORD_TAP_FINISHED (1) // the recording has stopped
+
+typedef struct jack_play_record_tap_reader {
+    uint32_t pid;              // 0 for a free slot
+    uint32_t reserved;
+    uint64_t read_frame;       // the reader's next frame
+} jack_play_record_tap_reader_t;
+
+typedef struct jack_play_record_tap_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;      // bytes, including readers[]
+    uint32_t nchans;
+    uint32_t samplerate;
+    uint32_t flags;
+    uint64_t capacity;         // frames in the ring, a power of 2
+    uint64_t data_offset;      // bytes from the start of the segment to the ring
+    uint64_t write_frame;      // frames written since the start, ever increasing
+    uint64_t claim_frame;      // write_frame once the copy in progress is done
+    uint64_t start_frame_time; // jack frame time of frame 0, once known
+
+    jack_play_record_tap_reader_t readers[JACK_PLAY_RECORD_TAP_MAX_READERS];
+} jack_play_record_tap_shm_t;
+
+#endif /* JACK_PLAY_RECORD_TAP_H */
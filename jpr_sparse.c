@@ -0,0 +1,351 @@
+/** @file jpr_sparse.c
+ *
+ * @brief Reading and writing jack_play_record's sparse block format, see
+ * jpr_sparse.h.  Structs are written as they are in memory, so this
+ * assumes a little endian machine.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpr_sparse.h"
+
+#define JPR_SPARSE_IO_BUFFER (1 << 20) // stdio buffering, so blocks go out in big writes
+
+/* The block scan.  Like jack_gain's meter, the peak is a max over the
+ * samples' magnitude bits as integers, which orders the same as the floats
+ * but lets gcc vectorize it (build with -O3); target_clones has it emit one
+ * copy per instruction set and pick the best for the running cpu.  With a
+ * mask of all ones the sign bit counts too, so -0.0 isn't taken for 0. */
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define JPR_SPARSE_SIMD_CLONES \
+    __attribute__((target_clones("avx512f", "avx2", "avx", "sse4.1", "default")))
+#else
+#define JPR_SPARSE_SIMD_CLONES
+#endif
+
+typedef uint32_t __attribute__((may_alias)) jpr_sparse_bits_t;
+
+JPR_SPARSE_SIMD_CLONES
+static uint32_t peak_bits(const float * restrict buf, uint32_t nframes, uint32_t mask) {
+    const jpr_sparse_bits_t *bits = (const jpr_sparse_bits_t *)buf;
+    uint32_t peak = 0, abits, fidx;
+
+    for(fidx=0; fidx<nframes; fidx++) {
+        abits = bits[fidx] & mask;
+        peak = abits > peak ? abits : peak;
+    }
+    return peak;
+}
+
+/* split interleaved frames in to the writer's planar block */
+JPR_SPARSE_SIMD_CLONES
+static void deinterleave(float * restrict planar, const float * restrict frames,
+                         uint32_t nchans, uint32_t block_frames, uint32_t offset, uint32_t nframes) {
+    uint32_t cidx, fidx;
+
+    for(cidx=0; cidx<nchans; cidx++) {
+        float *chan = planar + cidx * block_frames + offset;
+        for(fidx=0; fidx<nframes; fidx++) {
+            chan[fidx] = frames[fidx * nchans + cidx];
+        }
+    }
+}
+
+static jpr_sparse_t *jpr_sparse_alloc(FILE *fp) {
+    jpr_sparse_t *sp = calloc(1, sizeof(jpr_sparse_t));
+
+    if(sp == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    sp->fp = fp;
+    setvbuf(fp, NULL, _IOFBF, JPR_SPARSE_IO_BUFFER);
+    return sp;
+}
+
+static int jpr_sparse_alloc_block(jpr_sparse_t *sp) {
+    size_t size = sizeof(float) * sp->header.nchans * sp->header.block_frames;
+
+    sp->planar = malloc(size);
+    sp->interleaved = malloc(size);
+    return sp->planar == NULL || sp->interleaved == NULL;
+}
+
+jpr_sparse_t *jpr_sparse_create(const char *fname, int nchans, int samplerate, float threshold) {
+    jpr_sparse_t *sp;
+    FILE *fp;
+
+    if(nchans < 1 || nchans > JPR_SPARSE_MAX_CHANS || (fp = fopen(fname, "wb")) == NULL) {
+        return NULL;
+    }
+    if((sp = jpr_sparse_alloc(fp)) == NULL) {
+        return NULL;
+    }
+    sp->writing = 1;
+    sp->header.magic = JPR_SPARSE_MAGIC;
+    sp->header.version = JPR_SPARSE_VERSION;
+    sp->header.nchans = nchans;
+    sp->header.samplerate = samplerate;
+    sp->header.block_frames = JPR_SPARSE_BLOCK_FRAMES;
+    sp->header.threshold = threshold;
+    if(jpr_sparse_alloc_block(sp) || fwrite(&(sp->header), sizeof(sp->header), 1, fp) != 1) {
+        jpr_sparse_close(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+jpr_sparse_t *jpr_sparse_open(const char *fname) {
+    jpr_sparse_t *sp;
+    FILE *fp;
+
+    if((fp = fopen(fname, "rb")) == NULL) {
+        return NULL;
+    }
+    if((sp = jpr_sparse_alloc(fp)) == NULL) {
+        return NULL;
+    }
+    if(fread(&(sp->header), sizeof(sp->header), 1, fp) != 1 ||
+       sp->header.magic != JPR_SPARSE_MAGIC || sp->header.version != JPR_SPARSE_VERSION ||
+       sp->header.nchans < 1 || sp->header.nchans > JPR_SPARSE_MAX_CHANS ||
+       sp->header.block_frames < 1 || jpr_sparse_alloc_block(sp)) {
+        jpr_sparse_close(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+int jpr_sparse_is_sparse(const char *fname) {
+    FILE *fp = fopen(fname, "rb");
+    uint32_t magic = 0;
+
+    if(fp == NULL) {
+        return 0;
+    }
+    if(fread(&magic, sizeof(magic), 1, fp) != 1) {
+        magic = 0;
+    }
+    fclose(fp);
+    return magic == JPR_SPARSE_MAGIC;
+}
+
+/* scan the writer's planar block and write it out, leaving out the
+ * channels that are silent enough */
+static int write_block(jpr_sparse_t *sp) {
+    jpr_sparse_block_t block = {sp->nbuffered, 0, 0};
+    uint32_t cidx, threshold_bits, mask;
+
+    memcpy(&threshold_bits, &(sp->header.threshold), sizeof(threshold_bits));
+    // at 0, only blocks of +0.0s read back exactly as what was recorded
+    mask = threshold_bits == 0 ? 0xffffffffu : 0x7fffffffu;
+    for(cidx=0; cidx<sp->header.nchans; cidx++) {
+        if(peak_bits(sp->planar + cidx * sp->header.block_frames, sp->nbuffered, mask) <= threshold_bits) {
+            block.sparse_mask |= (uint64_t)1 << cidx;
+            sp->nchanblocks_sparse++;
+        }
+    }
+
+    if(fwrite(&block, sizeof(block), 1, sp->fp) != 1) {
+        return 1;
+    }
+    for(cidx=0; cidx<sp->header.nchans; cidx++) {
+        if(!(block.sparse_mask & ((uint64_t)1 << cidx)) &&
+           fwrite(sp->planar + cidx * sp->header.block_frames, sizeof(float),
+                  sp->nbuffered, sp->fp) != sp->nbuffered) {
+            return 1;
+        }
+    }
+    sp->header.nframes += sp->nbuffered;
+    sp->nblocks++;
+    sp->nbuffered = 0;
+    return 0;
+}
+
+int jpr_sparse_writef(jpr_sparse_t *sp, const float *frames, int nframes) {
+    uint32_t n;
+    int nwritten = 0;
+
+    while(nwritten < nframes) {
+        n = sp->header.block_frames - sp->nbuffered;
+        n = n > (uint32_t)(nframes - nwritten) ? (uint32_t)(nframes - nwritten) : n;
+        deinterleave(sp->planar, frames + (size_t)nwritten * sp->header.nchans,
+            sp->header.nchans, sp->header.block_frames, sp->nbuffered, n);
+        sp->nbuffered += n;
+        nwritten += n;
+        if(sp->nbuffered == sp->header.block_frames && write_block(sp)) {
+            return nwritten - n;
+        }
+    }
+    return nwritten;
+}
+
+/* read the next block in to the reader's interleaved buffer; returns its
+ * number of frames, 0 at the end of the file */
+static uint32_t read_block(jpr_sparse_t *sp) {
+    jpr_sparse_block_t block;
+    uint32_t nchans = sp->header.nchans, cidx, fidx;
+
+    if(fread(&block, sizeof(block), 1, sp->fp) != 1 || block.nframes > sp->header.block_frames) {
+        return 0;
+    }
+    for(cidx=0; cidx<nchans; cidx++) {
+        float *chan = sp->planar + cidx * sp->header.block_frames;
+        if(block.sparse_mask & ((uint64_t)1 << cidx)) {
+            memset(chan, 0, sizeof(float) * block.nframes);
+        }
+        else if(fread(chan, sizeof(float), block.nframes, sp->fp) != block.nframes) {
+            return 0; // a block cut short by a crash
+        }
+    }
+    for(fidx=0; fidx<block.nframes; fidx++) {
+        for(cidx=0; cidx<nchans; cidx++) {
+            sp->interleaved[fidx * nchans + cidx] = sp->planar[cidx * sp->header.block_frames + fidx];
+        }
+    }
+    return block.nframes;
+}
+
+int jpr_sparse_readf(jpr_sparse_t *sp, float *frames, int nframes) {
+    uint32_t n;
+    int nread = 0;
+
+    while(nread < nframes) {
+        if(sp->nused == sp->nbuffered) {
+            sp->nused = 0;
+            if((sp->nbuffered = read_block(sp)) == 0) {
+                break;
+            }
+        }
+        n = sp->nbuffered - sp->nused;
+        n = n > (uint32_t)(nframes - nread) ? (uint32_t)(nframes - nread) : n;
+        memcpy(frames + (size_t)nread * sp->header.nchans,
+            sp->interleaved + (size_t)sp->nused * sp->header.nchans,
+            sizeof(float) * sp->header.nchans * n);
+        sp->nused += n;
+        nread += n;
+    }
+    return nread;
+}
+
+int jpr_sparse_rewind(jpr_sparse_t *sp) {
+    sp->nbuffered = sp->nused = 0;
+    return fseek(sp->fp, sizeof(jpr_sparse_header_t), SEEK_SET);
+}
+
+/* little endian fields of a WAV header */
+static uint8_t *put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v) {
+    p = put_le16(p, v & 0xffff);
+    return put_le16(p, v >> 16);
+}
+
+#define WAV_HEADER_MAX (12 + 8 + 40 + 12 + 8) // RIFF, extensible fmt, fact, data
+
+/* a float WAV header: the 18 byte fmt chunk for mono and stereo,
+ * WAVE_FORMAT_EXTENSIBLE for more channels, and the fact chunk float data
+ * needs; sizes are 0xffffffff past 4 GiB.  Returns its length. */
+static size_t wav_header(uint8_t *hdr, uint32_t nchans, uint32_t samplerate, uint64_t nframes) {
+    static const uint8_t ieee_float_guid[16] = {
+        0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+    uint64_t nbytes = nframes * nchans * sizeof(float);
+    uint32_t fmt_size = nchans > 2 ? 40 : 18;
+    size_t hdr_size = 12 + 8 + fmt_size + 12 + 8;
+    uint8_t *p = hdr;
+
+    p = put_le32(p, 0x46464952);                                    // "RIFF"
+    p = put_le32(p, nbytes + hdr_size - 8 > 0xffffffffu ? 0xffffffffu : (uint32_t)(nbytes + hdr_size - 8));
+    p = put_le32(p, 0x45564157);                                    // "WAVE"
+    p = put_le32(p, 0x20746d66);                                    // "fmt "
+    p = put_le32(p, fmt_size);
+    p = put_le16(p, nchans > 2 ? 0xfffe : 3);                       // extensible or IEEE float
+    p = put_le16(p, nchans);
+    p = put_le32(p, samplerate);
+    p = put_le32(p, samplerate * nchans * sizeof(float));
+    p = put_le16(p, nchans * sizeof(float));                        // bytes per frame
+    p = put_le16(p, 32);                                            // bits
+    if(nchans > 2) {
+        p = put_le16(p, 22);
+        p = put_le16(p, 32);                                        // valid bits
+        p = put_le32(p, 0);                                         // no speaker positions
+        memcpy(p, ieee_float_guid, sizeof(ieee_float_guid));
+        p += sizeof(ieee_float_guid);
+    }
+    else {
+        p = put_le16(p, 0);
+    }
+    p = put_le32(p, 0x74636166);                                    // "fact"
+    p = put_le32(p, 4);
+    p = put_le32(p, nframes > 0xffffffffu ? 0xffffffffu : (uint32_t)nframes);
+    p = put_le32(p, 0x61746164);                                    // "data"
+    p = put_le32(p, nbytes > 0xffffffffu ? 0xffffffffu : (uint32_t)nbytes);
+    return hdr_size;
+}
+
+int jpr_sparse_export_wav(const char *fname, const char *wavfname) {
+    jpr_sparse_t *sp = jpr_sparse_open(fname);
+    FILE *wav;
+    uint64_t nframes = 0;
+    uint8_t hdr[WAV_HEADER_MAX];
+    size_t hdr_size;
+    int nread, err = 0;
+
+    if(sp == NULL) {
+        return 1;
+    }
+    if((wav = fopen(wavfname, "wb")) == NULL) {
+        jpr_sparse_close(sp);
+        return 1;
+    }
+    setvbuf(wav, NULL, _IOFBF, JPR_SPARSE_IO_BUFFER);
+
+    // the header goes in once the length is known
+    hdr_size = wav_header(hdr, sp->header.nchans, sp->header.samplerate, 0);
+    fseek(wav, hdr_size, SEEK_SET);
+    while((nread = jpr_sparse_readf(sp, sp->planar, sp->header.block_frames)) > 0) {
+        if(fwrite(sp->planar, sizeof(float) * sp->header.nchans, nread, wav) != (size_t)nread) {
+            err = 1;
+            break;
+        }
+        nframes += nread;
+    }
+
+    wav_header(hdr, sp->header.nchans, sp->header.samplerate, nframes);
+    fseek(wav, 0, SEEK_SET);
+    err |= fwrite(hdr, hdr_size, 1, wav) != 1;
+
+    err |= fclose(wav) != 0;
+    jpr_sparse_close(sp);
+    return err;
+}
+
+int jpr_sparse_close(jpr_sparse_t *sp) {
+    int err = 0;
+
+    if(sp->writing && sp->fp != NULL) {
+        if(sp->nbuffered > 0) {
+            err |= write_block(sp);
+        }
+        // now the frame count is known
+        err |= fseek(sp->fp, 0, SEEK_SET);
+        err |= fwrite(&(sp->header), sizeof(sp->header), 1, sp->fp) != 1;
+        if(sp->nblocks > 0) {
+            printf("INFO: %.1f%% of channel blocks were silent and not stored\n",
+                100.0 * sp->nchanblocks_sparse / (sp->nblocks * sp->header.nchans));
+        }
+    }
+    if(sp->fp != NULL) {
+        err |= fclose(sp->fp) != 0;
+    }
+    free(sp->planar);
+    free(sp->interleaved);
+    free(sp);
+    return err;
+}
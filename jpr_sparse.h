@@ -0,0 +1,85 @@
+/** @file jpr_sparse.h
+ *
+ * @brief A block based multichannel file format for recordings where many
+ * channels are silent much of the time.
+ *
+ * The file is a header followed by blocks of up to block_frames frames.
+ * Each block starts with a jpr_sparse_block_t, whose sparse_mask has bit c
+ * set when channel c's peak over the block was at or below the file's
+ * threshold.  Those channels aren't stored, and read back as silence; every
+ * other channel follows, in channel order, as nframes 32 bit floats (i.e.
+ * planar, not interleaved).  All fields are little endian.
+ *
+ * With the default threshold of 0 only blocks of exact +0.0s are dropped (a
+ * -0.0 keeps its block), and the file reads back bit for bit.  A threshold above 0 trades that for
+ * space: near-silent blocks read back as zeros.
+ *
+ * nframes in the header is written when the file is closed, so it is 0 in a
+ * file whose recorder died; readers then read blocks until the end of file.
+ */
+
+#ifndef JPR_SPARSE_H
+#define JPR_SPARSE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define JPR_SPARSE_MAGIC (0x5352504a) // "JPRS", little endian
+#define JPR_SPARSE_VERSION (1)
+#define JPR_SPARSE_MAX_CHANS (64)    // one bit each in sparse_mask
+#define JPR_SPARSE_BLOCK_FRAMES (4096)
+
+typedef struct jpr_sparse_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nchans;
+    uint32_t samplerate;
+    uint32_t block_frames;
+    float threshold;           // linear peak, at or below which a block is dropped
+    uint64_t nframes;          // 0 until the file is closed
+} jpr_sparse_header_t;
+
+typedef struct jpr_sparse_block {
+    uint32_t nframes;          // block_frames, except in the last block
+    uint32_t reserved;
+    uint64_t sparse_mask;      // channels not stored in this block
+} jpr_sparse_block_t;
+
+typedef struct jpr_sparse {
+    FILE *fp;
+    jpr_sparse_header_t header;
+    int writing;
+    float *planar;             // one block, channel after channel
+    float *interleaved;        // the reader's current block
+    uint32_t nbuffered;        // frames in planar (writing) or interleaved (reading)
+    uint32_t nused;            // frames of interleaved already returned
+    uint64_t nblocks, nchanblocks_sparse; // for jpr_sparse_close's report
+} jpr_sparse_t;
+
+/* create fname for writing nchans channels; threshold is a linear peak */
+jpr_sparse_t *jpr_sparse_create(const char *fname, int nchans, int samplerate, float threshold);
+
+/* open fname for reading, checking its header */
+jpr_sparse_t *jpr_sparse_open(const char *fname);
+
+/* append nframes interleaved frames; returns the number written */
+int jpr_sparse_writef(jpr_sparse_t *sp, const float *frames, int nframes);
+
+/* read up to nframes interleaved frames; returns the number read, which is
+ * less than nframes only at the end of the file */
+int jpr_sparse_readf(jpr_sparse_t *sp, float *frames, int nframes);
+
+/* go back to the first frame of a file being read */
+int jpr_sparse_rewind(jpr_sparse_t *sp);
+
+/* whether fname starts with the sparse format's magic */
+int jpr_sparse_is_sparse(const char *fname);
+
+/* write fname's audio out as a 32 bit float WAV file; returns 0 on success */
+int jpr_sparse_export_wav(const char *fname, const char *wavfname);
+
+/* finish the file (writing the last block and the frame count, when
+ * writing) and free sp; returns 0 on success */
+int jpr_sparse_close(jpr_sparse_t *sp);
+
+#endif /* JPR_SPARSE_H */